@@ -26,10 +26,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_HTS_SET_THREAD_POOL
+#include <htslib/thread_pool.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BCL_X86_SIMD 1
+#endif
 
 #include "bclfile.h"
 
@@ -44,33 +62,621 @@ int bcl_tile2surface(int tile)
     return surface;
 }
 
-static int uncompressBlock(char* abSrc, int nLenSrc, char* abDst, int nLenDst )
+/*
+ * Build the CBCL lookup tables.
+ * Each CBCL record is bits_per_base + bits_per_qual bits, packed least
+ * significant bit first, so the usual 2/2 layout holds two clusters per
+ * byte, one per nibble. The low two bits of a record are the base and the
+ * rest are the quality bin, so a table with an entry for every record value
+ * maps it straight to a base or a quality score. If the bin isn't in the
+ * header's table (eg unbinned qualities) it is the quality score.
+ * A base with a quality score of zero is an 'N'
+ */
+static void cbcl_build_luts(cbcl_header_t *hdr)
+{
+    for (int record=0; record < (1 << hdr->record_bits); record++) {
+        int quality = record >> hdr->bits_per_base;
+        for (int n=0; n < hdr->qbin->end; n++) {
+            if (quality == hdr->qbin->entries[n]) {
+                quality = hdr->qscore->entries[n];
+                break;
+            }
+        }
+        hdr->qual_lut[record] = quality;
+        hdr->base_lut[record] = quality ? BCL_BASE_ARRAY[record & 0x03] : BCL_UNKNOWN_BASE;
+    }
+}
+
+/*
+ * Expand nbytes of CBCL data into 2*nbytes bases and qualities
+ * Returns the number of bytes processed
+ */
+static int cbcl_decode_scalar(const uint8_t *src, int nbytes, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)
+{
+    for (int i=0; i < nbytes; i++) {
+        uint8_t lo = src[i] & 0x0f;
+        uint8_t hi = src[i] >> 4;
+        bases[2*i] = base_lut[lo];      quals[2*i] = qual_lut[lo];
+        bases[2*i+1] = base_lut[hi];    quals[2*i+1] = qual_lut[hi];
+    }
+    return nbytes;
+}
+
+#ifdef BCL_X86_SIMD
+/*
+ * SSSE3 version: 16 bytes (32 clusters) at a time.
+ * The nibbles are interleaved into cluster order first, then pshufb does
+ * the 16 entry table lookups. Any tail is left for the scalar code.
+ */
+__attribute__((target("ssse3")))
+static int cbcl_decode_ssse3(const uint8_t *src, int nbytes, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)
+{
+    const __m128i blut = _mm_loadu_si128((const __m128i *)base_lut);
+    const __m128i qlut = _mm_loadu_si128((const __m128i *)qual_lut);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+
+    for (i=0; i+16 <= nbytes; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src+i));
+        __m128i lo = _mm_and_si128(v, mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i c0 = _mm_unpacklo_epi8(lo, hi);
+        __m128i c1 = _mm_unpackhi_epi8(lo, hi);
+        _mm_storeu_si128((__m128i *)(bases+2*i), _mm_shuffle_epi8(blut, c0));
+        _mm_storeu_si128((__m128i *)(bases+2*i+16), _mm_shuffle_epi8(blut, c1));
+        _mm_storeu_si128((__m128i *)(quals+2*i), _mm_shuffle_epi8(qlut, c0));
+        _mm_storeu_si128((__m128i *)(quals+2*i+16), _mm_shuffle_epi8(qlut, c1));
+    }
+    return i;
+}
+
+/*
+ * AVX2 version: 32 bytes (64 clusters) at a time.
+ * unpack works within 128 bit lanes, so the halves are put back in
+ * order with a permute before the lookups.
+ */
+__attribute__((target("avx2")))
+static int cbcl_decode_avx2(const uint8_t *src, int nbytes, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)
+{
+    const __m256i blut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)base_lut));
+    const __m256i qlut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)qual_lut));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i;
+
+    for (i=0; i+32 <= nbytes; i+=32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src+i));
+        __m256i lo = _mm256_and_si256(v, mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        __m256i ulo = _mm256_unpacklo_epi8(lo, hi);
+        __m256i uhi = _mm256_unpackhi_epi8(lo, hi);
+        __m256i c0 = _mm256_permute2x128_si256(ulo, uhi, 0x20);
+        __m256i c1 = _mm256_permute2x128_si256(ulo, uhi, 0x31);
+        _mm256_storeu_si256((__m256i *)(bases+2*i), _mm256_shuffle_epi8(blut, c0));
+        _mm256_storeu_si256((__m256i *)(bases+2*i+32), _mm256_shuffle_epi8(blut, c1));
+        _mm256_storeu_si256((__m256i *)(quals+2*i), _mm256_shuffle_epi8(qlut, c0));
+        _mm256_storeu_si256((__m256i *)(quals+2*i+32), _mm256_shuffle_epi8(qlut, c1));
+    }
+    return i;
+}
+#endif
+
+/*
+ * Expand nbytes of CBCL data into 2*nbytes bases and qualities,
+ * using the fastest decoder this CPU supports
+ */
+static void cbcl_decode(const uint8_t *src, int nbytes, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)
+{
+    int i = 0;
+#ifdef BCL_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))       i = cbcl_decode_avx2(src, nbytes, base_lut, qual_lut, bases, quals);
+    else if (__builtin_cpu_supports("ssse3")) i = cbcl_decode_ssse3(src, nbytes, base_lut, qual_lut, bases, quals);
+#endif
+    cbcl_decode_scalar(src+i, nbytes-i, base_lut, qual_lut, bases+2*i, quals+2*i);
+}
+
+/*
+ * Return record n of a block of bits-wide records
+ */
+static inline unsigned cbcl_record(const uint8_t *block, int n, int bits)
+{
+    int bit = n * bits;
+    unsigned v = block[bit >> 3];
+    if ((bit & 7) + bits > 8) v |= block[(bit >> 3) + 1] << 8;
+    return (v >> (bit & 7)) & ((1 << bits) - 1);
+}
+
+/*
+ * 4 bit records: the nibble decoders above, plus any odd nibble at either end
+ */
+static void cbcl_decode_4(const uint8_t *block, int first, int n, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)
 {
-    z_stream zInfo ={0};
-    zInfo.total_in=  zInfo.avail_in=  nLenSrc;
-    zInfo.total_out= zInfo.avail_out= nLenDst;
-    zInfo.next_in= abSrc;
-    zInfo.next_out= abDst;
+    int i = 0, nbytes;
+
+    if (n > 0 && (first & 1)) {
+        unsigned v = block[first >> 1] >> 4;
+        bases[0] = base_lut[v]; quals[0] = qual_lut[v];
+        i++;
+    }
+    nbytes = (n - i) / 2;
+    cbcl_decode(block + ((first + i) >> 1), nbytes, base_lut, qual_lut, bases+i, quals+i);
+    i += 2 * nbytes;
+    if (i < n) {
+        unsigned v = block[(first + i) >> 1] & 0x0f;
+        bases[i] = base_lut[v]; quals[i] = qual_lut[v];
+    }
+}
+
+/*
+ * Decoders for other record widths. Eight records always fill a whole
+ * number of bytes (bits bytes, in fact), so the main loop takes eight at a
+ * time with no per-record shifts or tests that aren't known at compile time.
+ * Records before the first such group, and after the last, are done one by one.
+ */
+#define CBCL_DECODER(BITS)                                                                      \
+static void cbcl_decode_##BITS(const uint8_t *block, int first, int n, const uint8_t *base_lut, \
+                               const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals)       \
+{                                                                                               \
+    int i = 0;                                                                                  \
+    for ( ; i < n && ((first + i) & 7); i++) {                                                  \
+        unsigned v = cbcl_record(block, first + i, BITS);                                       \
+        bases[i] = base_lut[v]; quals[i] = qual_lut[v];                                         \
+    }                                                                                           \
+    for ( ; i + 8 <= n; i += 8) {                                                               \
+        const uint8_t *p = block + (first + i) / 8 * BITS;                                      \
+        uint64_t v = 0;                                                                         \
+        for (int k=0; k < BITS; k++) v |= (uint64_t)p[k] << (8 * k);                            \
+        for (int k=0; k < 8; k++) {                                                             \
+            unsigned r = (v >> (k * BITS)) & ((1 << BITS) - 1);                                 \
+            bases[i+k] = base_lut[r]; quals[i+k] = qual_lut[r];                                 \
+        }                                                                                       \
+    }                                                                                           \
+    for ( ; i < n; i++) {                                                                       \
+        unsigned v = cbcl_record(block, first + i, BITS);                                       \
+        bases[i] = base_lut[v]; quals[i] = qual_lut[v];                                         \
+    }                                                                                           \
+}
+
+CBCL_DECODER(5)
+CBCL_DECODER(6)
+CBCL_DECODER(7)
+CBCL_DECODER(8)
+
+/*
+ * The decoder for each record width we support (2 bits per base, 2 to 6 bits per quality)
+ */
+static cbcl_decoder_t cbcl_decoders[9] = { NULL, NULL, NULL, NULL, cbcl_decode_4, cbcl_decode_5, cbcl_decode_6, cbcl_decode_7, cbcl_decode_8 };
+
+/*
+ * Per-thread inflate state.
+ * The compressed block buffer and the decompressor are kept for the life of
+ * the thread, so reading a tile doesn't need any allocation once the buffer
+ * has grown to the largest block seen.
+ */
+typedef struct {
+    char *compressed_block;
+    uint32_t compressed_block_max;
+    z_stream zs;
+    bool zs_init;
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *decompressor;
+#endif
+} inflate_state_t;
+
+static pthread_key_t inflate_key;
+static pthread_once_t inflate_key_once = PTHREAD_ONCE_INIT;
+
+static void free_inflate_state(void *arg)
+{
+    inflate_state_t *state = (inflate_state_t *)arg;
+    if (!state) return;
+    if (state->zs_init) inflateEnd(&state->zs);
+#ifdef HAVE_LIBDEFLATE
+    if (state->decompressor) libdeflate_free_decompressor(state->decompressor);
+#endif
+    free(state->compressed_block);
+    free(state);
+}
+
+static void make_inflate_key(void)
+{
+    pthread_key_create(&inflate_key, free_inflate_state);
+}
+
+static inflate_state_t *get_inflate_state(void)
+{
+    inflate_state_t *state;
+
+    pthread_once(&inflate_key_once, make_inflate_key);
+    state = pthread_getspecific(inflate_key);
+    if (!state) {
+        state = calloc(1, sizeof(inflate_state_t));
+        if (!state) return NULL;
+        pthread_setspecific(inflate_key, state);
+    }
+    return state;
+}
+
+/*
+ * return the thread's compressed block buffer, making sure it holds at least size bytes
+ */
+static char *get_compressed_block(inflate_state_t *state, uint32_t size)
+{
+    if (state->compressed_block_max < size) {
+        char *p = realloc(state->compressed_block, size);
+        if (!p) return NULL;
+        state->compressed_block = p;
+        state->compressed_block_max = size;
+    }
+    return state->compressed_block;
+}
+
+static int uncompressBlock(inflate_state_t *state, char* abSrc, int nLenSrc, char* abDst, int nLenDst )
+{
+#ifdef HAVE_LIBDEFLATE
+    if (!state->decompressor) state->decompressor = libdeflate_alloc_decompressor();
+    if (state->decompressor) {
+        size_t nOut = 0;
+        if (libdeflate_gzip_decompress(state->decompressor, abSrc, nLenSrc, abDst, nLenDst, &nOut) == LIBDEFLATE_SUCCESS) {
+            if (nOut != nLenDst) fprintf(stderr,"inflate() returned %d: expected %d\n",(int)nOut,nLenDst);
+            return nOut;
+        }
+        // not a single complete gzip member, so let zlib have a go
+    }
+#endif
 
+    z_stream *zInfo = &state->zs;
     int nErr, nRet= -1;
-    nErr= inflateInit2( &zInfo, 15+32 );               // zlib function
+
+    if (state->zs_init) {
+        nErr= inflateReset( zInfo );
+    } else {
+        memset(zInfo, 0, sizeof(z_stream));
+        nErr= inflateInit2( zInfo, 15+32 );               // zlib function
+        if (nErr == Z_OK) state->zs_init = true;
+    }
     if (nErr != Z_OK) fprintf(stderr,"inflateInit() failed: %d\n", nErr);
+
+    zInfo->avail_in=  nLenSrc;
+    zInfo->avail_out= nLenDst;
+    zInfo->next_in= (Bytef *)abSrc;
+    zInfo->next_out= (Bytef *)abDst;
+
     if ( nErr == Z_OK ) {
-        nErr= inflate( &zInfo, Z_FINISH );     // zlib function
+        nErr= inflate( zInfo, Z_FINISH );     // zlib function
         if ( (nErr == Z_STREAM_END) || (nErr == Z_BUF_ERROR) ) {
-            nRet= zInfo.total_out;
+            nRet= zInfo->total_out;
             if (nRet != nLenDst) fprintf(stderr,"inflate() returned %d: expected %d\n",nRet,nLenDst);
             nErr = Z_OK;
         }
         if (nErr != Z_OK) {
             fprintf(stderr,"inflate() returned: %d\n", nErr);
-            fprintf(stderr,"avail_in=%d  avail_out=%d  total_out=%ld\n", zInfo.avail_in, zInfo.avail_out, zInfo.total_out);
+            fprintf(stderr,"avail_in=%d  avail_out=%d  total_out=%ld\n", zInfo->avail_in, zInfo->avail_out, zInfo->total_out);
         }
     }
-    inflateEnd( &zInfo );   // zlib function
     return( nRet ); // -1 or len of output
 }
 
+/*
+ * CBCL header cache.
+ * Every tile opens every cycle file again, so each header is parsed once
+ * and kept here, keyed by file name. An entry is only used if the file's
+ * size and modification time still match; otherwise a new one is parsed
+ * (the old one may still be in use by an open handle, so it is kept).
+ */
+#define CBCL_CACHE_BUCKETS 1024
+
+static cbcl_header_t *cbcl_cache[CBCL_CACHE_BUCKETS];
+static pthread_mutex_t cbcl_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// memory map CBCL files rather than reading them
+static bool cbcl_use_mmap = false;
+
+/*
+ * Memory map CBCL files opened from now on, instead of reading the tile
+ * blocks with pread(). The mapping is kept with the cached header, so
+ * each file is only mapped once.
+ */
+void bclfile_set_mmap(bool use_mmap)
+{
+    cbcl_use_mmap = use_mmap;
+}
+
+// time the inflation of CBCL blocks
+static bool bcl_keep_stats = false;
+
+/*
+ * Add the time spent inflating each CBCL block to the file's inflate_time.
+ * bytes_read is always kept, as it costs nothing.
+ */
+void bclfile_set_stats(bool keep_stats)
+{
+    bcl_keep_stats = keep_stats;
+}
+
+static unsigned int cbcl_cache_hash(const char *s)
+{
+    unsigned int h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h % CBCL_CACHE_BUCKETS;
+}
+
+static void cbcl_header_free(cbcl_header_t *hdr)
+{
+    if (!hdr) return;
+    free(hdr->filename);
+    ia_free(hdr->qbin);
+    ia_free(hdr->qscore);
+    va_free(hdr->tiles);
+    free(hdr->tile_offset);
+    free(hdr->tile_slot);
+    if (hdr->map) munmap(hdr->map, hdr->map_size);
+    free(hdr);
+}
+
+/*
+ * Parse a CBCL header, reading it from the file in one go.
+ * Returns NULL if the header could not be read or is malformed
+ */
+static cbcl_header_t *cbcl_header_parse(int fd, char *fname, struct stat *st)
+{
+    cbcl_header_t *hdr = NULL;
+    uint8_t fixed[6];
+    uint8_t *buf = NULL, *p, *end;
+    off_t offset;
+
+#define CBCL_GET(v) do { if (p + sizeof(v) > end) goto fail; memcpy(&(v), p, sizeof(v)); p += sizeof(v); } while (0)
+
+    if (pread(fd, fixed, sizeof(fixed), 0) != sizeof(fixed)) return NULL;
+
+    hdr = calloc(1, sizeof(cbcl_header_t));
+    if (!hdr) return NULL;
+    hdr->filename = strdup(fname);
+    hdr->file_size = st->st_size;
+    hdr->mtime = st->st_mtime;
+    hdr->qbin = ia_init(10);
+    hdr->qscore = ia_init(10);
+    hdr->tiles = va_init(500,free);
+
+    memcpy(&hdr->version, fixed, sizeof(hdr->version));
+    memcpy(&hdr->header_size, fixed + sizeof(hdr->version), sizeof(hdr->header_size));
+    if (hdr->header_size < sizeof(fixed) || hdr->header_size > st->st_size) goto fail;
+
+    buf = malloc(hdr->header_size);
+    if (!buf) goto fail;
+    if (pread(fd, buf, hdr->header_size, 0) != hdr->header_size) goto fail;
+    p = buf + sizeof(fixed);
+    end = buf + hdr->header_size;
+
+    CBCL_GET(hdr->bits_per_base);
+    CBCL_GET(hdr->bits_per_qual);
+    CBCL_GET(hdr->nbins);
+    for (int n=0; n < hdr->nbins; n++) {
+        uint32_t qbin, qscore;
+        CBCL_GET(qbin);
+        CBCL_GET(qscore);
+        ia_push(hdr->qbin, qbin);
+        ia_push(hdr->qscore, qscore);
+    }
+    CBCL_GET(hdr->ntiles);
+    if (hdr->ntiles > (end - p) / (4 * sizeof(uint32_t))) goto fail;
+    hdr->tile_offset = malloc((hdr->ntiles+1) * sizeof(off_t));
+    if (!hdr->tile_offset) goto fail;
+    offset = hdr->header_size;
+    for (int n=0; n < hdr->ntiles; n++) {
+        tilerec_t *tilerec = calloc(1, sizeof(tilerec_t));
+        if (!tilerec) goto fail;
+        va_push(hdr->tiles, tilerec);
+        CBCL_GET(tilerec->tilenum);
+        CBCL_GET(tilerec->nclusters);
+        CBCL_GET(tilerec->uncompressed_blocksize);
+        CBCL_GET(tilerec->compressed_blocksize);
+        hdr->tile_offset[n] = offset;
+        offset += tilerec->compressed_blocksize;
+    }
+    hdr->tile_offset[hdr->ntiles] = offset;
+    CBCL_GET(hdr->pfFlag);
+#undef CBCL_GET
+
+    // index the tiles by tile number
+    hdr->min_tile = 0; hdr->max_tile = -1;
+    for (int n=0; n < hdr->ntiles; n++) {
+        tilerec_t *tilerec = hdr->tiles->entries[n];
+        if (n == 0 || tilerec->tilenum < hdr->min_tile) hdr->min_tile = tilerec->tilenum;
+        if (n == 0 || tilerec->tilenum > hdr->max_tile) hdr->max_tile = tilerec->tilenum;
+    }
+    if (hdr->ntiles) {
+        hdr->tile_slot = malloc((hdr->max_tile - hdr->min_tile + 1) * sizeof(int));
+        if (!hdr->tile_slot) goto fail;
+        memset(hdr->tile_slot, 0xff, (hdr->max_tile - hdr->min_tile + 1) * sizeof(int));
+        for (int n=hdr->ntiles-1; n >= 0; n--) {
+            tilerec_t *tilerec = hdr->tiles->entries[n];
+            hdr->tile_slot[tilerec->tilenum - hdr->min_tile] = n;
+        }
+    }
+
+    hdr->record_bits = hdr->bits_per_base + hdr->bits_per_qual;
+    if (hdr->bits_per_base == 2 && hdr->record_bits >= 4 && hdr->record_bits <= 8) cbcl_build_luts(hdr);
+    free(buf);
+
+    // if we can't map the file, we just read it instead
+    if (cbcl_use_mmap && st->st_size > 0) {
+        void *map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            hdr->map = map;
+            hdr->map_size = st->st_size;
+        }
+    }
+    return hdr;
+
+fail:
+    free(buf);
+    cbcl_header_free(hdr);
+    return NULL;
+}
+
+/*
+ * Find the header for the open CBCL file fname in the cache, parsing it
+ * and adding it to the cache if it's not there.
+ * Returns NULL if the header could not be read
+ */
+static cbcl_header_t *cbcl_header_get(int fd, char *fname)
+{
+    struct stat st;
+    unsigned int h = cbcl_cache_hash(fname);
+    cbcl_header_t *hdr;
+
+    if (fstat(fd, &st) < 0) return NULL;
+
+    pthread_mutex_lock(&cbcl_cache_lock);
+    for (hdr = cbcl_cache[h]; hdr; hdr = hdr->next) {
+        if (strcmp(hdr->filename, fname) == 0 && hdr->file_size == st.st_size && hdr->mtime == st.st_mtime) break;
+    }
+    pthread_mutex_unlock(&cbcl_cache_lock);
+    if (hdr) return hdr;
+
+    // parse outside the lock, so other threads can use the cache meanwhile
+    hdr = cbcl_header_parse(fd, fname, &st);
+    if (!hdr) return NULL;
+
+    pthread_mutex_lock(&cbcl_cache_lock);
+    cbcl_header_t *h2;
+    for (h2 = cbcl_cache[h]; h2; h2 = h2->next) {
+        if (strcmp(h2->filename, fname) == 0 && h2->file_size == st.st_size && h2->mtime == st.st_mtime) break;
+    }
+    if (h2) {
+        // another thread got there first
+        cbcl_header_free(hdr);
+        hdr = h2;
+    } else {
+        hdr->next = cbcl_cache[h];
+        cbcl_cache[h] = hdr;
+    }
+    pthread_mutex_unlock(&cbcl_cache_lock);
+    return hdr;
+}
+
+/*
+ * Free all the cached CBCL headers.
+ * There must not be any CBCL files open when this is called.
+ */
+void bclfile_free_header_cache(void)
+{
+    pthread_mutex_lock(&cbcl_cache_lock);
+    for (int n=0; n < CBCL_CACHE_BUCKETS; n++) {
+        while (cbcl_cache[n]) {
+            cbcl_header_t *hdr = cbcl_cache[n];
+            cbcl_cache[n] = hdr->next;
+            cbcl_header_free(hdr);
+        }
+    }
+    pthread_mutex_unlock(&cbcl_cache_lock);
+}
+
+/*
+ * Read up to n bytes from whichever kind of file this is, bypassing the read buffer.
+ * Returns the number of bytes read, 0 at end of file, or -1 on error
+ */
+static int bclfile_raw_read(bclfile_t *bcl, void *dst, int n)
+{
+    int r;
+    if (bcl->bgzfhandle)    r = bgzf_read(bcl->bgzfhandle, dst, n);
+    else if (bcl->gzhandle) r = gzread(bcl->gzhandle, dst, n);
+    else                    r = read(bcl->fhandle, dst, n);
+    if (r > 0) bcl->bytes_read += r;
+    return r;
+}
+
+/*
+ * Read the gzip header of the BGZF block at offset, and return the
+ * size of the whole block, or -1 if it isn't a BGZF block
+ */
+static int bgzf_block_size(int fd, int64_t offset)
+{
+    uint8_t h[18];
+
+    if (pread(fd, h, sizeof(h), (off_t)offset) != sizeof(h)) return -1;
+    if (h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4)) return -1;
+    if (h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0) return -1;
+    return (h[16] | (h[17] << 8)) + 1;
+}
+
+/*
+ * Open fname with htslib's BGZF reader if it really is BGZF.
+ * The file descriptor is kept in fhandle so the block headers can be
+ * read with pread() when we need to seek.
+ * Returns true if the file was opened
+ */
+static bool bgzf_open_blocked(bclfile_t *bcl, char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) return false;
+    if (bgzf_block_size(fd, 0) < 0) {
+        close(fd);
+        return false;
+    }
+    bcl->bgzfhandle = bgzf_dopen(fd, "r");
+    if (!bcl->bgzfhandle) {
+        close(fd);
+        return false;
+    }
+    bcl->fhandle = fd;
+    return true;
+}
+
+/*
+ * Walk the BGZF block headers to find the compressed and uncompressed
+ * offset of every block. Only the header and the ISIZE field at the end of
+ * each block is read, so nothing is inflated.
+ * Returns 0 on success, -1 on error
+ */
+static int bgzf_index_blocks(bclfile_t *bcl)
+{
+    int64_t coffset = 0, uoffset = 0;
+    int max = 0;
+    int bsize;
+
+    bcl->nblocks = 0;
+    while ( (bsize = bgzf_block_size(bcl->fhandle, coffset)) > 0) {
+        uint8_t isize[4];
+        if (pread(bcl->fhandle, isize, 4, (off_t)(coffset + bsize - 4)) != 4) return -1;
+        if (bcl->nblocks >= max) {
+            max = max ? max * 2 : 64;
+            bcl->block_coffset = realloc(bcl->block_coffset, max * sizeof(int64_t));
+            bcl->block_uoffset = realloc(bcl->block_uoffset, max * sizeof(int64_t));
+            if (!bcl->block_coffset || !bcl->block_uoffset) return -1;
+        }
+        bcl->block_coffset[bcl->nblocks] = coffset;
+        bcl->block_uoffset[bcl->nblocks] = uoffset;
+        bcl->nblocks++;
+        coffset += bsize;
+        uoffset += isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint32_t)isize[3] << 24);
+    }
+    return bcl->nblocks ? 0 : -1;
+}
+
+/*
+ * Seek to uncompressed offset in a BGZF file, jumping straight to the block
+ */
+static int bgzf_seek_uoffset(bclfile_t *bcl, int64_t offset)
+{
+    int lo = 0, hi;
+
+    if (!bcl->nblocks && bgzf_index_blocks(bcl) < 0) {
+        fprintf(stderr,"bclfile_seek(): failed to read BGZF blocks in %s\n", bcl->filename);
+        return -1;
+    }
+
+    // find the last block starting at or before offset
+    hi = bcl->nblocks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (bcl->block_uoffset[mid] <= offset) lo = mid;
+        else                                  hi = mid - 1;
+    }
+    if (offset - bcl->block_uoffset[lo] > 0xffff) return -1;
+    return bgzf_seek(bcl->bgzfhandle, (bcl->block_coffset[lo] << 16) | (offset - bcl->block_uoffset[lo]), SEEK_SET) < 0 ? -1 : 0;
+}
+
 /*
  * Try to open the given bcl/scl file.
  * If that doesn't work, try appending ".gz" and gzopen it
@@ -82,18 +688,22 @@ bclfile_t *bclfile_open(char *fname)
     bclfile->current_cluster = 0;
     bclfile->total_clusters = 0;
     bclfile->gzhandle = NULL;
+    bclfile->bgzfhandle = NULL;
     bclfile->file_type = BCL_UNKNOWN;
     bclfile->current_base = 0;
     bclfile->filename = strdup(fname);
     bclfile->nbins = 0;
-    bclfile->qbin = ia_init(10);
-    bclfile->qscore = ia_init(10);
-    bclfile->tiles = va_init(500,free);
+    bclfile->header = NULL;
     bclfile->current_block = NULL;
     bclfile->current_block_size = 0;
+    bclfile->current_block_max = 0;
     bclfile->surface = 1;
+    bclfile->buffer = NULL;
+    bclfile->buffer_size = BCL_BUFFER_SIZE;
+    bclfile->buffer_len = 0;
+    bclfile->buffer_index = 0;
     char *gzfname = NULL;
-    int r, n;
+    int r;
 
     // need to find if this is a BCL or SCL file
     if (strstr(fname,".bcl")) bclfile->file_type = BCL_BCL;
@@ -118,8 +728,8 @@ bclfile_t *bclfile_open(char *fname)
         bclfile->gzhandle = gzopen(gzfname,"r");
         if (bclfile->gzhandle == NULL) {
             strcpy(gzfname,fname); strcat(gzfname,".bgzf");
-            bclfile->gzhandle = gzopen(gzfname,"r");
-            if (bclfile->gzhandle == NULL) {
+            if (!bgzf_open_blocked(bclfile, gzfname)) bclfile->gzhandle = gzopen(gzfname,"r");
+            if (bclfile->gzhandle == NULL && bclfile->bgzfhandle == NULL) {
                 bclfile->errmsg = strdup(strerror(errno));
                 free(gzfname);
                 return bclfile;
@@ -131,79 +741,142 @@ bclfile_t *bclfile_open(char *fname)
 
     while (true) {
         if (bclfile->file_type == BCL_BCL || bclfile->file_type == BCL_SCL) {
-            if (bclfile->gzhandle) r = gzread(bclfile->gzhandle,(void *)&bclfile->total_clusters,4);
-            else                   r = read(bclfile->fhandle, (void *)&bclfile->total_clusters, 4);
+            r = bclfile_raw_read(bclfile, (void *)&bclfile->total_clusters, 4);
             if (r <= 0) break;
         }
 
         if (bclfile->file_type == BCL_CBCL) {
-            r = read(bclfile->fhandle, (void *)&bclfile->version, sizeof(bclfile->version)); if (r<=0) break;
-            r = read(bclfile->fhandle, (void *)&bclfile->header_size, sizeof(bclfile->header_size)); if (r<=0) break;
-            r = read(bclfile->fhandle, (void *)&bclfile->bits_per_base, sizeof(bclfile->bits_per_base)); if (r<=0) break;
-            r = read(bclfile->fhandle, (void *)&bclfile->bits_per_qual, sizeof(bclfile->bits_per_qual)); if (r<=0) break;
-            r = read(bclfile->fhandle, (void *)&bclfile->nbins, sizeof(bclfile->nbins)); if (r<=0) break;
-            for (n=0; n < bclfile->nbins; n++) {
-                uint32_t qbin, qscore;
-                r = read(bclfile->fhandle, (void *)&qbin, sizeof(qbin)); if (r<=0) break;
-                r = read(bclfile->fhandle, (void *)&qscore, sizeof(qscore)); if (r<=0) break;
-                ia_push(bclfile->qbin, qbin);
-                ia_push(bclfile->qscore, qscore);
-            }
-            r = read(bclfile->fhandle, (void *)&bclfile->ntiles, sizeof(bclfile->ntiles)); if (r<=0) break;
-            for (n=0; n < bclfile->ntiles; n++) {
-                tilerec_t *tilerec = calloc(1, sizeof(tilerec_t));
-                uint32_t x;
-                r = read(bclfile->fhandle, (void *)&x, sizeof(x)); if (r<=0) break;
-                tilerec->tilenum = x;
-                r = read(bclfile->fhandle, (void *)&x, sizeof(x)); if (r<=0) break;
-                tilerec->nclusters = x;
-                r = read(bclfile->fhandle, (void *)&x, sizeof(x)); if (r<=0) break;
-                tilerec->uncompressed_blocksize = x;
-                r = read(bclfile->fhandle, (void *)&x, sizeof(x)); if (r<=0) break;
-                tilerec->compressed_blocksize = x;
-                va_push(bclfile->tiles, tilerec);
-                if (!bclfile->current_tile) bclfile->current_tile = tilerec;
-            }
-            r = read(bclfile->fhandle, (void *)&bclfile->pfFlag, sizeof(bclfile->pfFlag));
+            cbcl_header_t *hdr = gzfname ? NULL : cbcl_header_get(bclfile->fhandle, fname);
+            r = hdr ? 1 : 0;
+            if (!hdr) break;
+            bclfile->header = hdr;
+            bclfile->version = hdr->version;
+            bclfile->header_size = hdr->header_size;
+            bclfile->bits_per_base = hdr->bits_per_base;
+            bclfile->bits_per_qual = hdr->bits_per_qual;
+            bclfile->nbins = hdr->nbins;
+            bclfile->qbin = hdr->qbin;
+            bclfile->qscore = hdr->qscore;
+            bclfile->ntiles = hdr->ntiles;
+            bclfile->tiles = hdr->tiles;
+            bclfile->pfFlag = hdr->pfFlag;
+            bclfile->current_tile = hdr->ntiles ? hdr->tiles->entries[0] : NULL;
+            memcpy(bclfile->base_lut, hdr->base_lut, sizeof(bclfile->base_lut));
+            memcpy(bclfile->qual_lut, hdr->qual_lut, sizeof(bclfile->qual_lut));
         }
         break;
     }
 
     if (r <= 0) {
-        fprintf(stderr,"failed to read header from bcl file '%s'\n", bclfile->gzhandle ? gzfname : fname);
+        fprintf(stderr,"failed to read header from bcl file '%s'\n", gzfname ? gzfname : fname);
         bclfile_close(bclfile); bclfile = NULL;
     }
 
-    if (bclfile->file_type == BCL_CBCL) {
+    if (bclfile && bclfile->file_type == BCL_CBCL) {
         if (bclfile->bits_per_base != 2) {
-            fprintf(stderr,"CBCL file '%s' has bits_per_base %d : expecting 2\n", (bclfile->gzhandle ? gzfname : fname), bclfile->bits_per_base);
+            fprintf(stderr,"CBCL file '%s' has bits_per_base %d : expecting 2\n", (gzfname ? gzfname : fname), bclfile->bits_per_base);
             bclfile_close(bclfile); bclfile = NULL;
         }
-        if (bclfile->bits_per_qual != 2) {
-            fprintf(stderr,"CBCL file '%s' has bits_per_qual %d : expecting 2\n", (bclfile->gzhandle ? gzfname : fname), bclfile->bits_per_qual);
+        else if (bclfile->bits_per_qual < 2 || bclfile->bits_per_qual > 6) {
+            fprintf(stderr,"CBCL file '%s' has bits_per_qual %d : expecting 2 to 6\n", (gzfname ? gzfname : fname), bclfile->bits_per_qual);
             bclfile_close(bclfile); bclfile = NULL;
         }
+        else {
+            bclfile->decode = cbcl_decoders[bclfile->header->record_bits];
+        }
     }
 
     free(gzfname);
     return bclfile;
 }
 
+/*
+ * Set the size of the read buffer used for uncompressed BCL and SCL files.
+ * Any data already in the buffer is discarded, so this should be called
+ * before reading, or followed by a bclfile_seek()
+ */
+void bclfile_set_buffer_size(bclfile_t *bcl, int size)
+{
+    if (size < 1) size = 1;
+    free(bcl->buffer);
+    bcl->buffer = NULL;
+    bcl->buffer_size = size;
+    bcl->buffer_len = 0;
+    bcl->buffer_index = 0;
+}
+
+/*
+ * Refill the read buffer from the file.
+ * Returns the number of bytes read, 0 at end of file, or -1 on error
+ */
+static int bclfile_fill_buffer(bclfile_t *bcl)
+{
+    if (!bcl->buffer) {
+        bcl->buffer = malloc(bcl->buffer_size);
+        if (!bcl->buffer) {
+            fprintf(stderr,"bclfile_fill_buffer(): failed to malloc %d bytes for %s\n", bcl->buffer_size, bcl->filename);
+            return -1;
+        }
+    }
+    bcl->buffer_index = 0;
+    bcl->buffer_len = bclfile_raw_read(bcl, (void *)bcl->buffer, bcl->buffer_size);
+    if (bcl->buffer_len < 0) {
+        bcl->buffer_len = 0;
+        return -1;
+    }
+    return bcl->buffer_len;
+}
+
 void bclfile_seek(bclfile_t *bcl, int cluster)
 {
-    if (bcl->gzhandle) {
+    if (bcl->bgzfhandle) {
+        if (bgzf_seek_uoffset(bcl, 4 + cluster) < 0) fprintf(stderr,"bclfile_seek(%d) failed for %s\n", cluster, bcl->filename);
+    } else if (bcl->gzhandle) {
         gzseek(bcl->gzhandle, (z_off_t)(4 + cluster), SEEK_SET);
     } else {
         lseek(bcl->fhandle, (off_t)(4 + cluster), SEEK_SET);
     }
+    // discard anything already buffered
+    bcl->buffer_len = 0;
+    bcl->buffer_index = 0;
+}
+
+/*
+ * Return the index of tile in the CBCL tile list, or -1 if it's not there
+ */
+static int cbcl_find_tile(cbcl_header_t *hdr, int tile)
+{
+    if (tile < hdr->min_tile || tile > hdr->max_tile) return -1;
+    return hdr->tile_slot[tile - hdr->min_tile];
+}
+
+/*
+ * madvise() the part of a mapped CBCL file between start and end.
+ * WILLNEED covers every page touching the range; DONTNEED only whole
+ * pages inside it, so we don't drop the start of a neighbouring block.
+ */
+static void cbcl_advise(cbcl_header_t *hdr, off_t start, off_t end, int advice)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (end > hdr->map_size) end = hdr->map_size;
+    if (advice == MADV_DONTNEED) {
+        start = (start + pagesize - 1) / pagesize * pagesize;
+        end = end / pagesize * pagesize;
+    } else {
+        start = start / pagesize * pagesize;
+    }
+    if (start < end) madvise(hdr->map + start, end - start, advice);
 }
 
 int bclfile_seek_tile(bclfile_t *bcl, int tile)
 {
-    int offset;
-    bool found = false;
+    off_t offset;
+    int slot;
     tilerec_t *ti;
+    cbcl_header_t *hdr;
     char *compressed_block = NULL;
+    inflate_state_t *state;
     int r;
 
     if (bcl->file_type != BCL_CBCL) {
@@ -216,42 +889,67 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile)
         return 0;
     }
 
-    offset = bcl->header_size;
-    for (int n=0; n < bcl->tiles->end; n++) {
-        ti = (tilerec_t *)bcl->tiles->entries[n];
-        if (ti->tilenum == tile) {
-            found = true;
-            break;
-        }
-        offset += ti->compressed_blocksize;
-    }
-    if (!found) {
+    hdr = bcl->header;
+    slot = cbcl_find_tile(hdr, tile);
+    if (slot < 0) {
         fprintf(stderr,"bclfile_seek_tile(%d) : no such tile\n", tile);
         return -1;
     }
+    ti = (tilerec_t *)bcl->tiles->entries[slot];
+    offset = hdr->tile_offset[slot];
 
     bcl->current_tile = ti;
-    lseek(bcl->fhandle, (off_t)offset, SEEK_SET);
-    free(bcl->current_block);
     bcl->current_block_size = ti->uncompressed_blocksize;
-    bcl->current_block = malloc(ti->uncompressed_blocksize);
-    if (!bcl->current_block) {
-        fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc current_block\n", tile);
-        return -1;
+    if (bcl->current_block_max < ti->uncompressed_blocksize) {
+        free(bcl->current_block);
+        bcl->current_block_max = 0;
+        bcl->current_block = malloc(ti->uncompressed_blocksize);
+        if (!bcl->current_block) {
+            fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc current_block\n", tile);
+            return -1;
+        }
+        bcl->current_block_max = ti->uncompressed_blocksize;
     }
-    compressed_block = malloc(ti->compressed_blocksize);
-    if (!compressed_block) {
-        fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc compressed_block\n", tile);
+    state = get_inflate_state();
+    if (!state) {
+        fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc inflate state\n", tile);
         return -1;
     }
-    r = read(bcl->fhandle, (void *)compressed_block, ti->compressed_blocksize);
-    if (r != ti->compressed_blocksize) {
-        fprintf(stderr,"bclfile_seek_tile(%d): failed to read block: returned %d\n", tile, r);
-        return -1;
+    if (hdr->map) {
+        if (offset + ti->compressed_blocksize > hdr->map_size) {
+            fprintf(stderr,"bclfile_seek_tile(%d): block is past the end of %s\n", tile, bcl->filename);
+            return -1;
+        }
+        // inflate straight from the mapping, and ask for the next block to be read in
+        compressed_block = hdr->map + offset;
+        if (slot+1 < hdr->ntiles) cbcl_advise(hdr, hdr->tile_offset[slot+1], hdr->tile_offset[slot+2], MADV_WILLNEED);
+    } else {
+        compressed_block = get_compressed_block(state, ti->compressed_blocksize);
+        if (!compressed_block) {
+            fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc compressed_block\n", tile);
+            return -1;
+        }
+        r = pread(bcl->fhandle, (void *)compressed_block, ti->compressed_blocksize, (off_t)offset);
+        if (r != ti->compressed_blocksize) {
+            fprintf(stderr,"bclfile_seek_tile(%d): failed to read block: returned %d\n", tile, r);
+            return -1;
+        }
     }
-    r=uncompressBlock(compressed_block, ti->compressed_blocksize, bcl->current_block, ti->uncompressed_blocksize);
-    bcl->current_block_ptr = bcl->current_block;
-    free(compressed_block);
+    struct timespec start;
+    if (bcl_keep_stats) clock_gettime(CLOCK_MONOTONIC, &start);
+    r=uncompressBlock(state, compressed_block, ti->compressed_blocksize, bcl->current_block, ti->uncompressed_blocksize);
+    if (bcl_keep_stats) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bcl->inflate_time += (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    bcl->bytes_read += ti->compressed_blocksize;
+    // we've finished with this part of the mapping
+    if (hdr->map) cbcl_advise(hdr, offset, offset + ti->compressed_blocksize, MADV_DONTNEED);
+    bcl->block_cluster = 0;
+    // don't count any padding at the end of the block as a cluster
+    bcl->block_clusters = ti->uncompressed_blocksize * 8 / hdr->record_bits;
+    if (bcl->block_clusters > ti->nclusters) bcl->block_clusters = ti->nclusters;
     if (r<0) {
         fprintf(stderr,"uncompressBlock() somehow failed in bclfile_seek_tile(%d)\n", tile);
         fprintf(stderr,"compressed_blocksize %d   uncompressed_blocksize %d\n", ti->compressed_blocksize, ti->uncompressed_blocksize);
@@ -260,83 +958,274 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile)
     return r;
 }
 
+/*
+ * Threads shared by all the callers of bclfile_seek_tiles()
+ */
+struct bclfile_pool_s {
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    hts_tpool *tpool;
+#endif
+    int nthreads;
+};
+
+/*
+ * Create a pool of nthreads threads to inflate CBCL blocks.
+ * Returns NULL if there are no threads to be had, when bclfile_seek_tiles() inflates the blocks itself.
+ */
+bclfile_pool_t *bclfile_pool_init(int nthreads)
+{
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    if (nthreads < 1) return NULL;
+    bclfile_pool_t *pool = calloc(1, sizeof(bclfile_pool_t));
+    if (!pool) return NULL;
+    pool->tpool = hts_tpool_init(nthreads);
+    if (!pool->tpool) {
+        free(pool);
+        return NULL;
+    }
+    pool->nthreads = nthreads;
+    return pool;
+#else
+    return NULL;
+#endif
+}
+
+void bclfile_pool_destroy(bclfile_pool_t *pool)
+{
+    if (!pool) return;
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    hts_tpool_destroy(pool->tpool);
+#endif
+    free(pool);
+}
+
+/*
+ * Data shared by the threads seeking the files for one call of bclfile_seek_tiles()
+ */
+typedef struct {
+    va_t *bcls;
+    int tile;
+    int next;
+    int failed;
+} seek_tiles_job_t;
+
+static void *seek_tiles_worker(void *arg)
+{
+    seek_tiles_job_t *job = (seek_tiles_job_t *)arg;
+    int n;
+
+    while ( (n = __sync_fetch_and_add(&job->next, 1)) < job->bcls->end) {
+        bclfile_t *bcl = job->bcls->entries[n];
+        if (bcl->file_type == BCL_CBCL && bclfile_seek_tile(bcl, job->tile) < 0) {
+            __sync_fetch_and_add(&job->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Seek to the given tile in every CBCL file in the bcls array, reading and
+ * inflating the blocks on this thread and any free threads in the pool.
+ * pool may be NULL, to do it all on this thread.
+ * Files which are not CBCL are ignored.
+ *
+ * Returns 0 on success, or -1 if the seek failed for any file
+ */
+int bclfile_seek_tiles(va_t *bcls, int tile, bclfile_pool_t *pool)
+{
+    seek_tiles_job_t job = { bcls, tile, 0, 0 };
+
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    int nhelpers = pool ? pool->nthreads : 0;
+    if (nhelpers > bcls->end - 1) nhelpers = bcls->end - 1;
+    hts_tpool_process *q = nhelpers > 0 ? hts_tpool_process_init(pool->tpool, nhelpers, 1) : NULL;
+    // each helper takes files from the list until there are none left, as this thread does
+    for (int n=0; q && n < nhelpers; n++) {
+        if (hts_tpool_dispatch(pool->tpool, q, seek_tiles_worker, &job) < 0) break;
+    }
+    seek_tiles_worker(&job);
+    if (q) {
+        hts_tpool_process_flush(q);
+        hts_tpool_process_destroy(q);
+    }
+#else
+    seek_tiles_worker(&job);
+#endif
+
+    return job.failed ? -1 : 0;
+}
+
+/*
+ * Move to the given cluster in the current tile of a CBCL file.
+ * For CBCL files with the pfFlag set, the cluster counts only those which passed the filter.
+ *
+ * Returns 0 on success, or -1 if this isn't a CBCL file
+ */
+int bclfile_seek_cluster(bclfile_t *bcl, int cluster)
+{
+    if (bcl->file_type != BCL_CBCL) return -1;
+    if (cluster > bcl->block_clusters) cluster = bcl->block_clusters;
+    bcl->block_cluster = cluster;
+    return 0;
+}
+
 void bclfile_close(bclfile_t *bclfile)
 {
-    if (bclfile->gzhandle) {
+    if (bclfile->bgzfhandle) {
+        bgzf_close(bclfile->bgzfhandle);    // this closes fhandle too
+    } else if (bclfile->gzhandle) {
         gzclose(bclfile->gzhandle);
     } else {
         if (bclfile->fhandle != -1) close(bclfile->fhandle);
     }
+    free(bclfile->block_coffset);
+    free(bclfile->block_uoffset);
     free(bclfile->filename);
     free(bclfile->errmsg);
-    ia_free(bclfile->qbin);
-    ia_free(bclfile->qscore);
-    va_free(bclfile->tiles);
+    // the CBCL header, qbin, qscore and tiles belong to the header cache
     free(bclfile->current_block);
+    free(bclfile->buffer);
     free(bclfile);
 }
 
+/*
+ * Read up to n raw bytes, using up anything in the read buffer first.
+ * Returns the number of bytes read, or -1 on error
+ */
+static int bclfile_read_bytes(bclfile_t *bcl, uint8_t *dst, int n)
+{
+    int got = 0;
+    int avail = bcl->buffer_len - bcl->buffer_index;
+
+    if (avail > 0) {
+        if (avail > n) avail = n;
+        memcpy(dst, bcl->buffer + bcl->buffer_index, avail);
+        bcl->buffer_index += avail;
+        got = avail;
+    }
+
+    while (got < n) {
+        int r = bclfile_raw_read(bcl, (void *)(dst+got), n-got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+/*
+ * Decode the next n clusters into the bases and quals arrays.
+ * Bases are ASCII, qualities are Phred scores (not offset by 33).
+ * quals may be NULL for SCL files, which don't have qualities.
+ *
+ * Returns the number of clusters decoded (which may be less than n at
+ * the end of the file or CBCL tile block), or -1 on error
+ */
+int bclfile_load_tile(bclfile_t *bcl, uint8_t *bases, uint8_t *quals, int n)
+{
+    int i = 0;
+
+    if (n <= 0) return 0;
+
+    if (bcl->file_type == BCL_BCL) {
+        // read the raw bytes into quals, then decode in place
+        int r = bclfile_read_bytes(bcl, quals, n);
+        if (r < 0) return -1;
+        for (i=0; i < r; i++) {
+            unsigned char c = quals[i];
+            quals[i] = c >> 2;
+            bases[i] = quals[i] ? BCL_BASE_ARRAY[c & 0x03] : BCL_UNKNOWN_BASE;
+        }
+    }
+
+    if (bcl->file_type == BCL_SCL) {
+        // four clusters per byte, so just use bclfile_next()
+        for (i=0; i < n; i++) {
+            if (bclfile_next(bcl) < 0) break;
+            bases[i] = bcl->base;
+            if (quals) quals[i] = 0;
+        }
+        return i;
+    }
+
+    if (bcl->file_type == BCL_CBCL) {
+        if (bcl->current_block == NULL) {
+            if (bclfile_seek_tile(bcl, bcl->current_tile->tilenum) < 0) return -1;
+        }
+
+        i = bcl->block_clusters - bcl->block_cluster;
+        if (i > n) i = n;
+        if (i > 0) {
+            bcl->decode((uint8_t *)bcl->current_block, bcl->block_cluster, i, bcl->base_lut, bcl->qual_lut, bases, quals);
+            bcl->block_cluster += i;
+        }
+    }
+
+    if (i > 0) {
+        bcl->current_cluster += i;
+        bcl->base = bases[i-1];
+        bcl->quality = quals[i-1];
+    }
+    return i;
+}
+
+/*
+ * Expand the whole of the current CBCL tile block into bases and qualities.
+ * qual_offset is added to each quality (eg 33 for Phred+33).
+ * The bases and quals arrays must have room for 2 * current_block_size
+ * clusters.
+ *
+ * This does not change the current read position.
+ * Returns the number of clusters decoded, or -1 on error
+ */
+int bclfile_decode_block(bclfile_t *bcl, uint8_t *bases, uint8_t *quals, int qual_offset)
+{
+    uint8_t qual_lut[256];
+
+    if (bcl->file_type != BCL_CBCL) {
+        fprintf(stderr,"ERROR: calling bclfile_decode_block() for non CBCL file type\n");
+        return -1;
+    }
+
+    if (bcl->current_block == NULL) {
+        if (bclfile_seek_tile(bcl, bcl->current_tile->tilenum) < 0) return -1;
+    }
+
+    for (int n=0; n < 256; n++) qual_lut[n] = bcl->qual_lut[n] + qual_offset;
+    bcl->decode((uint8_t *)bcl->current_block, 0, bcl->block_clusters, bcl->base_lut, qual_lut, bases, quals);
+    return bcl->block_clusters;
+}
+
 int bclfile_next(bclfile_t *bcl)
 {
-    int i=0;
     unsigned char c = 0;
 
     if (bcl->file_type == BCL_CBCL) {
+        unsigned v;
         if (bcl->current_block == NULL) {
             //tilerec_t *t = bcl->tiles->entries[0];
             tilerec_t *t = bcl->current_tile;
-            bclfile_seek_tile(bcl, t->tilenum);
-            bcl->block_index = 0;
-            bcl->current_block_ptr = bcl->current_block;
+            if (bclfile_seek_tile(bcl, t->tilenum) < 0) return -1;
         }
+        if (bcl->block_cluster >= bcl->block_clusters) {
+            return -1;
+        }
+        v = cbcl_record((uint8_t *)bcl->current_block, bcl->block_cluster++, bcl->header->record_bits);
+        bcl->base = bcl->base_lut[v];
+        bcl->quality = bcl->qual_lut[v];
+        bcl->current_cluster++;
+        return 0;
     }
 
     if (bcl->current_base == 0) {
-        if (bcl->gzhandle) {
-            i = gzgetc(bcl->gzhandle);
-            if (i<0) return i;
-            bcl->current_byte = i;
-        } else {
-            if (bcl->file_type == BCL_CBCL) {
-                if (bcl->block_index >= bcl->current_block_size) {
-                    return -1;
-                }
-                bcl->current_byte = *(bcl->current_block_ptr);
-                bcl->current_block_ptr++;
-                bcl->block_index++;
-            } else {
-                if (read(bcl->fhandle, (void *)&(bcl->current_byte), 1) != 1) return -1;
-            }
+        if (bcl->buffer_index >= bcl->buffer_len) {
+            if (bclfile_fill_buffer(bcl) <= 0) return -1;
         }
+        bcl->current_byte = bcl->buffer[bcl->buffer_index++];
     }
 
     c = bcl->current_byte;
 
-    if (bcl->file_type == BCL_CBCL) {
-        int baseIndex = 0;
-        switch (bcl->current_base) {
-            case 1: baseIndex = (c >> 4) & 0x03;    
-                    bcl->quality = (c >> 6) & 0x03;
-                    break;
-            case 0: baseIndex = c & 0x03;           
-                    bcl->quality = (c >> 2) & 0x03;
-                    break;
-        }
-        bcl->base = BCL_BASE_ARRAY[baseIndex];
-        // convert quality bin number to quality score
-        for (int n=0; n < bcl->qbin->end; n++) {
-            if (bcl->quality == bcl->qbin->entries[n]) {
-                bcl->quality = bcl->qscore->entries[n];
-                break;
-            }
-        }
-        if (!bcl->quality) {
-            bcl->base = BCL_UNKNOWN_BASE;
-        }
-        bcl->current_base++;
-        if (bcl->current_base > 1) bcl->current_base = 0;
-    }
-
     if (bcl->file_type == BCL_SCL) {
         int baseIndex = 0;
         switch (bcl->current_base) {
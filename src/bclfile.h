@@ -22,22 +22,67 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define __BCLFILE_H__
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include <zlib.h>
+#include <htslib/bgzf.h>
 #include "array.h"
 
+// size of the read buffer used for BCL and SCL files
+#define BCL_BUFFER_SIZE (64*1024)
+
 typedef enum { BCL_UNKNOWN, BCL_BCL, BCL_SCL, BCL_CBCL } BCL_FILE_TYPE;
 
+// threads for bclfile_seek_tiles(), shared by all its callers
+typedef struct bclfile_pool_s bclfile_pool_t;
+
+/*
+ * Decode n CBCL records, starting at record first in block, into bases and quals
+ */
+typedef void (*cbcl_decoder_t)(const uint8_t *block, int first, int n, const uint8_t *base_lut, const uint8_t *qual_lut, uint8_t *bases, uint8_t *quals);
+
 typedef struct {
     uint32_t  tilenum;
     uint32_t  nclusters;
     uint32_t  uncompressed_blocksize;
     uint32_t  compressed_blocksize;
 } tilerec_t;
-    
+
+/*
+ * A parsed CBCL header. These are cached, keyed by file name, and
+ * shared read-only between all the bclfile_t handles open on that file.
+ */
+typedef struct cbcl_header_s {
+    char *filename;
+    off_t file_size;
+    time_t mtime;
+    uint16_t version;
+    uint32_t header_size;
+    unsigned char bits_per_base;
+    unsigned char bits_per_qual;
+    uint32_t nbins;
+    ia_t *qbin;
+    ia_t *qscore;
+    uint32_t ntiles;
+    va_t *tiles;
+    off_t *tile_offset;     // file offset of each tile's compressed block
+    int min_tile;           // tile_slot[tile-min_tile] is the index of tile in tiles, or -1
+    int max_tile;
+    int *tile_slot;
+    char *map;              // the whole file, if it is memory mapped
+    size_t map_size;
+    char pfFlag;
+    int record_bits;        // bits_per_base + bits_per_qual
+    uint8_t base_lut[256];  // indexed by a whole record
+    uint8_t qual_lut[256];
+    struct cbcl_header_s *next;
+} cbcl_header_t;
+
 typedef struct {
     BCL_FILE_TYPE file_type;
     int fhandle;
     gzFile gzhandle;
+    BGZF *bgzfhandle;
     char *errmsg;
     uint32_t total_clusters;
     int current_cluster;
@@ -46,7 +91,6 @@ typedef struct {
     int quality;
     char *filename;
     char current_byte;
-    int block_index;
     // CBCL specific fields
     uint16_t version;
     uint32_t header_size;
@@ -56,13 +100,32 @@ typedef struct {
     ia_t *qbin;
     ia_t *qscore;
     uint32_t ntiles;
+    cbcl_header_t *header;
     tilerec_t *current_tile;
     va_t *tiles;
     char *current_block;
-    char *current_block_ptr;
     uint32_t current_block_size;
+    uint32_t current_block_max;
     char pfFlag;
     int surface;
+    // CBCL record decoding, chosen when the file is opened
+    int block_cluster;      // next record in current_block
+    int block_clusters;     // number of records in current_block
+    cbcl_decoder_t decode;
+    uint8_t base_lut[256];
+    uint8_t qual_lut[256];
+    // read buffer for BCL and SCL files
+    char *buffer;
+    int buffer_size;
+    int buffer_len;
+    int buffer_index;
+    // BGZF block offsets (compressed and uncompressed), built on the first seek
+    int nblocks;
+    int64_t *block_coffset;
+    int64_t *block_uoffset;
+    // statistics
+    uint64_t bytes_read;    // compressed bytes for CBCL files, uncompressed for BCL and SCL files
+    double inflate_time;    // seconds spent inflating CBCL blocks, if bclfile_set_stats() was called
 } bclfile_t;
 
 int bcl_tile2surface(int tile);
@@ -71,5 +134,15 @@ int bclfile_next(bclfile_t *bclfile);
 void bclfile_close(bclfile_t *bclfile);
 void bclfile_seek(bclfile_t *bclfile, int cluster);
 int bclfile_seek_tile(bclfile_t *bclfile, int tile);
+int bclfile_seek_tiles(va_t *bcls, int tile, bclfile_pool_t *pool);
+int bclfile_seek_cluster(bclfile_t *bcl, int cluster);
+void bclfile_set_buffer_size(bclfile_t *bclfile, int size);
+int bclfile_load_tile(bclfile_t *bclfile, uint8_t *bases, uint8_t *quals, int n);
+int bclfile_decode_block(bclfile_t *bclfile, uint8_t *bases, uint8_t *quals, int qual_offset);
+void bclfile_free_header_cache(void);
+void bclfile_set_mmap(bool use_mmap);
+void bclfile_set_stats(bool keep_stats);
+bclfile_pool_t *bclfile_pool_init(int nthreads);
+void bclfile_pool_destroy(bclfile_pool_t *pool);
 #endif
 
@@ -25,16 +25,49 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "filterfile.h"
 
-filter_t *filter_open(char *fname)
+/*
+ * Map the whole file into memory, or read it if it can't be mapped.
+ * Returns 0 on success, -1 on error
+ */
+static int filter_load(filter_t *filter)
 {
-    uint32_t empty;
+    struct stat st;
+
+    if (fstat(filter->fhandle, &st) < 0) return -1;
+    filter->data_size = st.st_size;
+    filter->pos = 0;
+    if (filter->data_size == 0) return 0;
+
+    filter->data = mmap(NULL, filter->data_size, PROT_READ, MAP_PRIVATE, filter->fhandle, 0);
+    if (filter->data != MAP_FAILED) {
+        filter->mapped = true;
+        madvise(filter->data, filter->data_size, MADV_SEQUENTIAL);
+        return 0;
+    }
+
+    filter->data = malloc(filter->data_size);
+    if (!filter->data) return -1;
+    for (size_t n = 0; n < filter->data_size; ) {
+        ssize_t r = read(filter->fhandle, filter->data + n, filter->data_size - n);
+        if (r <= 0) return -1;
+        n += r;
+    }
+    return 0;
+}
 
+filter_t *filter_open(char *fname)
+{
     filter_t *filter = calloc(1, sizeof(filter_t));
     filter->total_clusters = 0;
     filter->current_cluster = 0;
@@ -43,43 +76,108 @@ filter_t *filter_open(char *fname)
     if (filter->fhandle == -1) {
         filter->errmsg = strdup(strerror(errno));
     } else {
-        int n;
         filter->errmsg=NULL;
-        n = read(filter->fhandle,(void *)&empty,4);
-        n = read(filter->fhandle,(void *)&filter->version,4);
-        n = read(filter->fhandle,(void *)&filter->total_clusters,4);
-        if (n<0) {
+        if (filter_load(filter) < 0 || filter->data_size < 12) {
             fprintf(stderr,"failed to read header from %s\n", fname);
             exit(1);
         }
+        // first 4 bytes are empty
+        memcpy(&filter->version, filter->data + 4, 4);
+        memcpy(&filter->total_clusters, filter->data + 8, 4);
+        filter->pos = 12;
     }
     return filter;
 }
 
 void filter_close(filter_t *filter)
 {
-    close(filter->fhandle);
+    if (filter->mapped)       munmap(filter->data, filter->data_size);
+    else if (!filter->shared) free(filter->data);
+    if (filter->fhandle >= 0) close(filter->fhandle);
     free(filter->errmsg);
     free(filter);
 }
 
+/*
+ * Lane level files are read by every tile thread, so they are opened once
+ * and shared. Each caller gets its own reader over the shared data.
+ * Failed opens are cached too, so that missing files are only looked for once.
+ */
+typedef struct filter_cache_s {
+    char *fname;
+    filter_t *filter;
+    struct filter_cache_s *next;
+} filter_cache_t;
+
+static filter_cache_t *filter_cache = NULL;
+static pthread_mutex_t filter_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+filter_t *filter_open_shared(char *fname)
+{
+    filter_cache_t *ent;
+
+    pthread_mutex_lock(&filter_cache_lock);
+    for (ent = filter_cache; ent; ent = ent->next) {
+        if (strcmp(ent->fname, fname) == 0) break;
+    }
+    if (!ent) {
+        ent = calloc(1, sizeof(filter_cache_t));
+        ent->fname = strdup(fname);
+        ent->filter = filter_open(fname);
+        // the whole file will be read, but not in order
+        if (ent->filter->mapped) {
+            madvise(ent->filter->data, ent->filter->data_size, MADV_NORMAL);
+            madvise(ent->filter->data, ent->filter->data_size, MADV_WILLNEED);
+        }
+        ent->next = filter_cache;
+        filter_cache = ent;
+    }
+    pthread_mutex_unlock(&filter_cache_lock);
+
+    filter_t *filter = malloc(sizeof(filter_t));
+    *filter = *ent->filter;
+    filter->fhandle = -1;
+    filter->mapped = false;
+    filter->shared = true;
+    if (filter->errmsg) filter->errmsg = strdup(filter->errmsg);
+    return filter;
+}
+
+/*
+ * Free all the shared files.
+ * There must not be any readers of them still open when this is called.
+ */
+void filter_free_shared_cache(void)
+{
+    pthread_mutex_lock(&filter_cache_lock);
+    while (filter_cache) {
+        filter_cache_t *ent = filter_cache;
+        filter_cache = ent->next;
+        filter_close(ent->filter);
+        free(ent->fname);
+        free(ent);
+    }
+    pthread_mutex_unlock(&filter_cache_lock);
+}
+
 void filter_seek(filter_t *filter, int cluster)
 {
-    off_t pos = 12 + cluster;
-    off_t n =lseek(filter->fhandle, pos, SEEK_SET);
-    if (n != pos) {
-        fprintf(stderr,"filter_seek(%d) failed: returned %d instead of %d\n", cluster, (int)n, (int)pos);
+    size_t pos = 12 + (size_t)cluster;
+    if (pos > filter->data_size) {
+        fprintf(stderr,"filter_seek(%d) failed: file is only %lu bytes\n", cluster, (unsigned long)filter->data_size);
         exit(1);
     }
+    filter->pos = pos;
 }
 
 int filter_next(filter_t *filter)
 {
     unsigned char next;
 
-    if (read(filter->fhandle, (void *)&next, 1) != 1) {
+    if (filter->pos >= filter->data_size) {
         return -1;
     }
+    next = filter->data[filter->pos++];
 
     filter->current_cluster++;
     next = next & 0x01;
@@ -87,3 +185,44 @@ int filter_next(filter_t *filter)
     return next;
 }
 
+/*
+ * Read the next n filter entries into a bitmap, one bit per cluster, set if the cluster
+ * passed the filter. pf must have room for (n+63)/64 words.
+ * Returns the number of entries read, which is less than n at the end of the file.
+ */
+int filter_load_tile(filter_t *filter, uint64_t *pf, int n)
+{
+    const uint8_t *data = filter->data + filter->pos;
+    int npf = 0;
+    int c = 0;
+
+    if (n > filter->data_size - filter->pos) n = filter->data_size - filter->pos;
+    if (n <= 0) return 0;
+
+    for (; c + 64 <= n; c += 64) {
+        uint64_t w;
+#ifdef __SSE2__
+        // shift bit 0 of each byte up to bit 7, where movemask can find it
+        w  = (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(_mm_loadu_si128((const __m128i *)(data + c)), 7));
+        w |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(_mm_loadu_si128((const __m128i *)(data + c + 16)), 7)) << 16;
+        w |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(_mm_loadu_si128((const __m128i *)(data + c + 32)), 7)) << 32;
+        w |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(_mm_loadu_si128((const __m128i *)(data + c + 48)), 7)) << 48;
+#else
+        w = 0;
+        for (int i = 0; i < 64; i++) w |= (uint64_t)(data[c+i] & 0x01) << i;
+#endif
+        pf[c/64] = w;
+        npf += __builtin_popcountll(w);
+    }
+    if (c < n) {
+        uint64_t w = 0;
+        for (int i = 0; c + i < n; i++) w |= (uint64_t)(data[c+i] & 0x01) << i;
+        pf[c/64] = w;
+        npf += __builtin_popcountll(w);
+    }
+
+    filter->pos += n;
+    filter->current_cluster += n;
+    filter->current_pf_cluster += npf;
+    return n;
+}
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define __FILTERFILE_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef struct {
     int fhandle;
@@ -30,11 +32,20 @@ typedef struct {
     uint32_t total_clusters;
     int current_cluster;
     int current_pf_cluster;
+    // the whole file, mapped or read into memory
+    uint8_t *data;
+    size_t data_size;
+    size_t pos;
+    bool mapped;
+    bool shared;        // data belongs to the shared file cache
 } filter_t;
 
 filter_t *filter_open(char *fname);
 int filter_next(filter_t *filter);
+int filter_load_tile(filter_t *filter, uint64_t *pf, int n);
 void filter_close(filter_t *filter);
+filter_t *filter_open_shared(char *fname);
+void filter_free_shared_cache(void);
 void filter_seek(filter_t *filter, int cluster);
 
 #endif
@@ -33,9 +33,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <libxml/xpath.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 
 #include <cram/sam_header.h>
+#ifdef HAVE_HTS_SET_THREAD_POOL
+#include <htslib/thread_pool.h>
+#endif
 
 #include "posfile.h"
 #include "filterfile.h"
@@ -55,70 +64,93 @@ char *strptime(const char *s, const char *format, struct tm *tm);
  */
 
 #define QUEUELEN "50000"
+#define REORDER_WINDOW "1000000"
+#define POLL_INTERVAL "60"
+#define TILE_BUFFER_CLUSTERS 4096
+#define MIN_SPLIT_CLUSTERS "16384"      // smallest range a worker will take from another
+#define SHARD_COPY_BUFFER 65536
+#define READ_NAME_BUFFER (128 + 24)     // a read name, and room for the position to overrun it before it is checked
+#define PROGRESS_INTERVAL "0"           // seconds between progress lines, or none
+
+#define xstr(s) str(s)
+#define str(s) #s
 
 static int machineType = -1;    // used to determin BCL file format in openBclFile()
 
+#define Q_BATCH 256      // records passed to or from the queue at a time
+
+/*
+ * Bounded queue of records, written by the tile threads and read by the output thread.
+ * Both sides move records in batches, and block when the queue is full or empty.
+ */
 typedef struct {
     pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
     bam1_t **q;
-    int first, last, count;
+    int first, count;
     int qlen;
+    int producers;      // number of threads which may still push records
 } queue_t;
 
 /*
  * Initialise the Queue
  */
-static void q_init(queue_t *q, int qlen)
+static void q_init(queue_t *q, int qlen, int producers)
 {
+    if (qlen < 2) qlen = 2;     // room for at least one pair of records
     pthread_mutex_init(&q->mutex,NULL);
-    q->first = 0; q->last = qlen-1; q->count = 0;
+    pthread_cond_init(&q->not_full,NULL);
+    pthread_cond_init(&q->not_empty,NULL);
+    q->first = 0; q->count = 0;
     q->q = calloc(qlen, sizeof(bam1_t *));
     q->qlen = qlen;
+    q->producers = producers;
 }
 
 /*
- * quick push single item, no validation
- * No need for locking here, it's already done by q_push()
+ * Push n records onto the Queue, waiting until there is room for all of them.
+ * The records are pushed together, so pairs are never split and our output BAM is collated.
+ * n must not be more than the queue length.
  */
-static void _q_push(queue_t *q, bam1_t *rec)
+static void q_push(queue_t *q, bam1_t **recs, int n)
 {
-    q->last = (q->last+1) % q->qlen;
-    q->q[ q->last ] = rec;
-    q->count++;
+    if (n <= 0) return;
+    if (pthread_mutex_lock(&q->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    while (q->count + n > q->qlen) pthread_cond_wait(&q->not_full, &q->mutex);
+    for (int i=0; i < n; i++) q->q[(q->first + q->count + i) % q->qlen] = recs[i];
+    q->count += n;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
 }
+
 /*
- * Push one or two records onto the Queue
- * We have to push two records atomically to ensure our output BAM is collated.
- * Return 0 on success, 1 if the Queue is already full
+ * Pop up to max records from the Queue into recs, waiting until there are some.
+ * Return the number of records, or 0 if the Queue is empty and there are no producers left.
  */
-static int q_push(queue_t *q, bam1_t *rec1, bam1_t *rec2)
+static int q_pop(queue_t *q, bam1_t **recs, int max)
 {
-    int retval = 1;
+    int n;
     if (pthread_mutex_lock(&q->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
-    if (q->count+1 < q->qlen) {
-        if (rec1) _q_push(q,rec1);
-        if (rec2) _q_push(q,rec2);
-        retval = 0;
-    }
+    while (q->count == 0 && q->producers > 0) pthread_cond_wait(&q->not_empty, &q->mutex);
+    n = q->count < max ? q->count : max;
+    for (int i=0; i < n; i++) recs[i] = q->q[(q->first + i) % q->qlen];
+    q->first = (q->first + n) % q->qlen;
+    q->count -= n;
+    if (n) pthread_cond_broadcast(&q->not_full);
     pthread_mutex_unlock(&q->mutex);
-    return retval;
+    return n;
 }
 
 /*
- * Pop an item from the Queue.
- * Return the item, or NULL if the Queue is empty.
+ * Called by each producer when it has pushed all of its records
  */
-static bam1_t *q_pop(queue_t *q)
+static void q_producer_done(queue_t *q)
 {
-    bam1_t *rec = NULL;
     if (pthread_mutex_lock(&q->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
-    if (q->count > 0) {
-        rec = q->q[q->first];
-        q->first = (q->first+1) % q->qlen;
-        q->count--;
-    }
+    q->producers--;
+    pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->mutex);
-    return rec;
 }
 
 /*
@@ -126,10 +158,344 @@ static bam1_t *q_pop(queue_t *q)
  */
 static void q_destroy(queue_t *q)
 {
-    if (q) free(q->q);
+    if (q) {
+        free(q->q);
+        pthread_mutex_destroy(&q->mutex);
+        pthread_cond_destroy(&q->not_full);
+        pthread_cond_destroy(&q->not_empty);
+    }
     free(q);
 }
 
+/*
+ * Pool of free BAM records.
+ * The output thread gives records back here once they are written, and the tile threads
+ * take them to build new ones, so record data is reused at its largest size instead of
+ * being allocated in one thread and freed in another. Records move a batch at a time.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    bam1_t **recs;
+    int n;
+    int size;               // most records kept; any more given back are freed
+} recPool_t;
+
+static recPool_t *rp_init(int size)
+{
+    recPool_t *pool = calloc(1, sizeof(recPool_t));
+    if (pool) pool->recs = calloc(size > 0 ? size : 1, sizeof(bam1_t *));
+    if (!pool || !pool->recs) { fprintf(stderr,"Can't allocate memory for record pool\n"); exit(1); }
+    pthread_mutex_init(&pool->mutex,NULL);
+    pool->size = size;
+    return pool;
+}
+
+/*
+ * Take up to max records from the pool into recs.
+ * Returns the number taken, which is 0 if the pool is empty.
+ */
+static int rp_get(recPool_t *pool, bam1_t **recs, int max)
+{
+    if (pthread_mutex_lock(&pool->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    int n = pool->n < max ? pool->n : max;
+    pool->n -= n;
+    memcpy(recs, pool->recs + pool->n, n * sizeof(bam1_t *));
+    pthread_mutex_unlock(&pool->mutex);
+    return n;
+}
+
+/*
+ * Give n records back to the pool
+ */
+static void rp_put(recPool_t *pool, bam1_t **recs, int n)
+{
+    if (pthread_mutex_lock(&pool->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    int keep = pool->size - pool->n < n ? pool->size - pool->n : n;
+    memcpy(pool->recs + pool->n, recs, keep * sizeof(bam1_t *));
+    pool->n += keep;
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i=keep; i < n; i++) bam_destroy1(recs[i]);
+}
+
+static void rp_destroy(recPool_t *pool)
+{
+    if (!pool) return;
+    for (int i=0; i < pool->n; i++) bam_destroy1(pool->recs[i]);
+    free(pool->recs);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/*
+ * Reorder buffer, for writing the records for each tile in tile order.
+ * A tile may be processed in several pieces, each a range of its clusters, by different
+ * worker threads. Each worker adds records to its own piece's buffer, and the output thread
+ * writes the pieces in order: by tile, then by first cluster.
+ * Records for pieces after the one being written are kept in memory, up to a total of
+ * window records, and then spilled to a temporary file, so that the workers
+ * never wait for a slow piece ahead of them.
+ */
+typedef struct piece_s {
+    int start, end;         // range of clusters in the tile
+    bam1_t **recs;          // records held in memory, in order
+    int next, n, m;
+    FILE *spill;            // records which were spilled, which come before those in memory
+    bool done;
+    struct piece_s *next_piece;
+} piece_t;
+
+typedef struct {
+    piece_t *pieces;        // in no particular order
+    int end;                // number of clusters in the tile, or -1 if not known yet
+} tileOutput_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    tileOutput_t *tiles;
+    int ntiles;
+    piece_t *head;          // the piece being written
+    int in_memory;          // records held in memory, over all pieces
+    int window;
+} reorder_t;
+
+static reorder_t *ro_init(int ntiles, int window)
+{
+    reorder_t *ro = calloc(1, sizeof(reorder_t));
+    if (!ro) { fprintf(stderr,"Can't allocate memory for reorder buffer\n"); exit(1); }
+    pthread_mutex_init(&ro->mutex,NULL);
+    pthread_cond_init(&ro->not_full,NULL);
+    pthread_cond_init(&ro->not_empty,NULL);
+    ro->tiles = calloc(ntiles ? ntiles : 1, sizeof(tileOutput_t));
+    for (int n=0; n < ntiles; n++) ro->tiles[n].end = -1;
+    ro->ntiles = ntiles;
+    ro->window = window < 1 ? 1 : window;
+    return ro;
+}
+
+static void freePiece(piece_t *piece)
+{
+    free(piece->recs);
+    if (piece->spill) fclose(piece->spill);
+    free(piece);
+}
+
+static void ro_destroy(reorder_t *ro)
+{
+    if (!ro) return;
+    for (int n=0; n < ro->ntiles; n++) {
+        while (ro->tiles[n].pieces) {
+            piece_t *piece = ro->tiles[n].pieces;
+            ro->tiles[n].pieces = piece->next_piece;
+            freePiece(piece);
+        }
+    }
+    free(ro->tiles);
+    pthread_mutex_destroy(&ro->mutex);
+    pthread_cond_destroy(&ro->not_full);
+    pthread_cond_destroy(&ro->not_empty);
+    free(ro);
+}
+
+/*
+ * Open an anonymous temporary file, in $TMPDIR if it is set
+ */
+static FILE *openSpillFile(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char *fname = malloc(strlen(dir ? dir : "/tmp") + 32);
+    sprintf(fname, "%s/bambi_i2b.XXXXXX", dir ? dir : "/tmp");
+    int fd = mkstemp(fname);
+    if (fd < 0) { fprintf(stderr,"Can't create temporary file %s: %s\n", fname, strerror(errno)); exit(1); }
+    unlink(fname);
+    free(fname);
+    FILE *fp = fdopen(fd, "w+");
+    if (!fp) { fprintf(stderr,"Can't open temporary file: %s\n", strerror(errno)); exit(1); }
+    return fp;
+}
+
+/*
+ * Write a record to a spill file, and free it.
+ * The file is only ever read back by this process, so the record is written as it is in memory.
+ */
+static void spillRecord(FILE *fp, bam1_t *rec)
+{
+    if (fwrite(&rec->core, sizeof(rec->core), 1, fp) != 1 ||
+        fwrite(&rec->l_data, sizeof(rec->l_data), 1, fp) != 1 ||
+        fwrite(rec->data, 1, rec->l_data, fp) != rec->l_data) {
+        fprintf(stderr,"Failed to write temporary file: %s\n", strerror(errno));
+        exit(1);
+    }
+    bam_destroy1(rec);
+}
+
+/*
+ * Read the next record written by spillRecord() into rec
+ * Returns false at the end of the file
+ */
+static bool unspillRecord(FILE *fp, bam1_t *rec)
+{
+    if (fread(&rec->core, sizeof(rec->core), 1, fp) != 1) return false;
+    if (fread(&rec->l_data, sizeof(rec->l_data), 1, fp) != 1) { fprintf(stderr,"Temporary file is truncated\n"); exit(1); }
+    if (rec->m_data < rec->l_data) {
+        rec->m_data = rec->l_data;
+        rec->data = realloc(rec->data, rec->m_data);
+    }
+    if (!rec->data || fread(rec->data, 1, rec->l_data, fp) != rec->l_data) {
+        fprintf(stderr,"Failed to read temporary file\n");
+        exit(1);
+    }
+    return true;
+}
+
+/*
+ * Add a piece for the clusters from start onwards in tile number idx (an index into the tile list)
+ */
+static piece_t *ro_add(reorder_t *ro, int idx, int start)
+{
+    piece_t *piece = calloc(1, sizeof(piece_t));
+    if (!piece) { fprintf(stderr,"Can't allocate memory for reorder buffer\n"); exit(1); }
+    piece->start = start;
+    piece->end = -1;
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    piece->next_piece = ro->tiles[idx].pieces;
+    ro->tiles[idx].pieces = piece;
+    pthread_cond_broadcast(&ro->not_empty);
+    pthread_mutex_unlock(&ro->mutex);
+    return piece;
+}
+
+/*
+ * Record the number of clusters in tile number idx
+ */
+static void ro_set_tile_end(reorder_t *ro, int idx, int end)
+{
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    ro->tiles[idx].end = end;
+    pthread_cond_broadcast(&ro->not_empty);
+    pthread_mutex_unlock(&ro->mutex);
+}
+
+/*
+ * Add n records to a piece
+ */
+static void ro_push(reorder_t *ro, piece_t *piece, bam1_t **recs, int n)
+{
+    if (n <= 0) return;
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    if (piece == ro->head) {
+        // the output thread is writing this piece, so wait for it to catch up
+        while (ro->in_memory + n > ro->window && piece->n > piece->next) pthread_cond_wait(&ro->not_full, &ro->mutex);
+    }
+    if (piece != ro->head && (piece->spill || ro->in_memory + n > ro->window)) {
+        if (!piece->spill) {
+            // everything already in memory has to go first
+            piece->spill = openSpillFile();
+            for (int i = piece->next; i < piece->n; i++) spillRecord(piece->spill, piece->recs[i]);
+            ro->in_memory -= piece->n - piece->next;
+            piece->next = piece->n = 0;
+        }
+        for (int i=0; i < n; i++) spillRecord(piece->spill, recs[i]);
+    } else {
+        if (piece->n + n > piece->m) {
+            // reuse the space already written before growing
+            if (piece->next) memmove(piece->recs, piece->recs + piece->next, (piece->n - piece->next) * sizeof(bam1_t *));
+            piece->n -= piece->next; piece->next = 0;
+            if (piece->n + n > piece->m) {
+                piece->m = (piece->n + n) * 2;
+                piece->recs = realloc(piece->recs, piece->m * sizeof(bam1_t *));
+                if (!piece->recs) { fprintf(stderr,"Can't allocate memory for reorder buffer\n"); exit(1); }
+            }
+        }
+        memcpy(piece->recs + piece->n, recs, n * sizeof(bam1_t *));
+        piece->n += n;
+        ro->in_memory += n;
+        if (piece == ro->head) pthread_cond_signal(&ro->not_empty);
+    }
+    pthread_mutex_unlock(&ro->mutex);
+}
+
+/*
+ * Called when all of the records for a piece have been added.
+ * end is where the piece finished, which may be before the end of the tile
+ */
+static void ro_done(reorder_t *ro, piece_t *piece, int end)
+{
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    piece->end = end;
+    piece->done = true;
+    if (piece == ro->head) pthread_cond_signal(&ro->not_empty);
+    pthread_mutex_unlock(&ro->mutex);
+}
+
+/*
+ * Called by the output thread to find the piece starting at cluster start in tile idx,
+ * waiting until it has been added, and make it the one being written.
+ * Its spill file, if any, is returned in *spill, and must be written before any records from ro_pop().
+ * Returns NULL if there are no more pieces in the tile.
+ */
+static piece_t *ro_start(reorder_t *ro, int idx, int start, FILE **spill)
+{
+    tileOutput_t *t = &ro->tiles[idx];
+    piece_t *piece;
+
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    for (;;) {
+        for (piece = t->pieces; piece; piece = piece->next_piece) {
+            if (piece->start == start) break;
+        }
+        if (piece || (t->end >= 0 && start >= t->end)) break;
+        pthread_cond_wait(&ro->not_empty, &ro->mutex);
+    }
+    ro->head = piece;
+    *spill = NULL;
+    if (piece) {
+        *spill = piece->spill;
+        piece->spill = NULL;
+        pthread_cond_broadcast(&ro->not_full);
+    }
+    pthread_mutex_unlock(&ro->mutex);
+    if (*spill) rewind(*spill);
+    return piece;
+}
+
+/*
+ * Get up to max records for the piece being written, waiting until there are some.
+ * Return the number of records, or 0 when the piece is finished.
+ */
+static int ro_pop(reorder_t *ro, bam1_t **recs, int max)
+{
+    piece_t *piece = ro->head;
+    int n;
+
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    while (piece->n == piece->next && !piece->done) pthread_cond_wait(&ro->not_empty, &ro->mutex);
+    n = piece->n - piece->next < max ? piece->n - piece->next : max;
+    if (n) {
+        memcpy(recs, piece->recs + piece->next, n * sizeof(bam1_t *));
+        piece->next += n;
+        ro->in_memory -= n;
+        pthread_cond_broadcast(&ro->not_full);
+    }
+    pthread_mutex_unlock(&ro->mutex);
+    return n;
+}
+
+/*
+ * Remove a finished piece from tile idx
+ */
+static void ro_finish(reorder_t *ro, int idx, piece_t *piece)
+{
+    if (pthread_mutex_lock(&ro->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    piece_t **p = &ro->tiles[idx].pieces;
+    while (*p != piece) p = &(*p)->next_piece;
+    *p = piece->next_piece;
+    ro->head = NULL;
+    pthread_mutex_unlock(&ro->mutex);
+    freePiece(piece);
+}
+
 /*
  * Cycle range array
  */
@@ -174,14 +540,226 @@ static void freeBCLReadArray(void *ent)
     free(ra);
 }
 
+/*
+ * Tile buffer.
+ * Holds the bases and qualities for a batch of clusters from a tile, one
+ * segment per read (read1, read2, readIndex, ...). Within a segment the data
+ * is cluster major: the bases are packed 2 bits each, and the qualities are
+ * a byte each. A base with a quality of zero is an 'N'.
+ */
+typedef struct {
+    bclReadArrayEntry_t *ra;
+    int ncycles;            // maximum number of cycles per cluster
+    int base_stride;        // bytes of packed bases per cluster
+    uint8_t *bases;
+    uint8_t *quals;
+    uint16_t *length;       // number of cycles actually read for each cluster
+} tileSegment_t;
+
+typedef struct {
+    int size;               // maximum number of clusters
+    int nclusters;          // number of clusters currently held
+    uint64_t *pf;           // bitmap of the clusters which passed the filter
+    int32_t *x;
+    int32_t *y;
+    va_t *segments;
+    uint8_t *tmp_bases;     // for bclfile_load_tile()
+    uint8_t *tmp_quals;
+    uint8_t *aux;           // aux data for the record being built
+    size_t aux_len;
+    size_t aux_max;
+} tileBuffer_t;
+
+static void freeTileSegment(void *ent)
+{
+    tileSegment_t *seg = (tileSegment_t *)ent;
+    free(seg->bases);
+    free(seg->quals);
+    free(seg->length);
+    free(seg);
+}
+
+static void freeTileBuffer(tileBuffer_t *tb)
+{
+    if (!tb) return;
+    free(tb->pf);
+    free(tb->x);
+    free(tb->y);
+    va_free(tb->segments);
+    free(tb->tmp_bases);
+    free(tb->tmp_quals);
+    free(tb->aux);
+    free(tb);
+}
+
+static tileBuffer_t *newTileBuffer(va_t *bclReadArray, int size)
+{
+    tileBuffer_t *tb = calloc(1, sizeof(tileBuffer_t));
+
+    tb->size = size;
+    tb->pf = calloc((size + 63) / 64, sizeof(uint64_t));
+    tb->x = calloc(size, sizeof(int32_t));
+    tb->y = calloc(size, sizeof(int32_t));
+    tb->tmp_bases = malloc(size);
+    tb->tmp_quals = malloc(size);
+    tb->segments = va_init(5, freeTileSegment);
+    for (int n=0; n < bclReadArray->end; n++) {
+        tileSegment_t *seg = calloc(1, sizeof(tileSegment_t));
+        seg->ra = bclReadArray->entries[n];
+        seg->ncycles = seg->ra->bclFileArray->end;
+        seg->base_stride = (seg->ncycles + 3) / 4;
+        seg->bases = calloc(size, seg->base_stride);
+        seg->quals = calloc(size, seg->ncycles);
+        seg->length = calloc(size, sizeof(uint16_t));
+        if (!seg->bases || !seg->quals || !seg->length) {
+            fprintf(stderr,"Failed to allocate tile buffer for %s\n", seg->ra->readname);
+            exit(1);
+        }
+        va_push(tb->segments, seg);
+    }
+    if (!tb->pf || !tb->x || !tb->y || !tb->tmp_bases || !tb->tmp_quals) {
+        fprintf(stderr,"Failed to allocate tile buffer\n");
+        exit(1);
+    }
+    return tb;
+}
+
+static tileSegment_t *findTileSegment(tileBuffer_t *tb, char *readname)
+{
+    for (int n=0; n < tb->segments->end; n++) {
+        tileSegment_t *seg = tb->segments->entries[n];
+        if (strcmp(seg->ra->readname, readname) == 0) return seg;
+    }
+    return NULL;
+}
+
+static inline bool tilePassed(tileBuffer_t *tb, int cluster)
+{
+    return (tb->pf[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/*
+ * Read the next batch of clusters for the tile into the tile buffer.
+ * max_cluster is the last cluster in the tile, or -1 to read to the end of the filter file.
+ * If skip_filtered is set, the bases of clusters which failed the filter are not unpacked.
+ * Returns the number of clusters read, which is zero at the end of the tile
+ */
+static int loadTileBuffer(tileBuffer_t *tb, filter_t *filter, posfile_t *posfile, int max_cluster, int surface, bool skip_filtered)
+{
+    static const uint8_t base2bits[256] = { ['C'] = 1, ['G'] = 2, ['T'] = 3 };
+    int npf = 0;
+    int n = tb->size;
+
+    // filter and position of each cluster
+    if (max_cluster >= 0 && n > max_cluster - filter->current_cluster) n = max_cluster - filter->current_cluster;
+    n = filter_load_tile(filter, tb->pf, n);
+    tb->nclusters = n;
+    if (n <= 0) return 0;
+    for (int w=0; w < (n + 63) / 64; w++) npf += __builtin_popcountll(tb->pf[w]);
+
+    // a short position file leaves the remaining clusters at the last position read
+    for (int c = posfile_load_tile(posfile, tb->x, tb->y, n); c < n; c++) {
+        tb->x[c] = posfile->x;
+        tb->y[c] = posfile->y;
+    }
+
+    // then the bases and qualities, one cycle at a time
+    for (int s=0; s < tb->segments->end; s++) {
+        tileSegment_t *seg = tb->segments->entries[s];
+        memset(seg->bases, 0, n * seg->base_stride);
+        memset(seg->length, 0, n * sizeof(uint16_t));
+        for (int i=0; i < seg->ra->bclFileArray->end; i++) {
+            bclfile_t *bcl = seg->ra->bclFileArray->entries[i];
+            if (bcl->surface != surface) continue;    // ignore if this tile is not in this bcl file
+            // CBCL files with the pfFlag set only contain the clusters which passed the filter
+            bool pf_only = (bcl->file_type == BCL_CBCL) && bcl->pfFlag;
+            int count = pf_only ? npf : n;
+            if (bclfile_load_tile(bcl, tb->tmp_bases, tb->tmp_quals, count) != count) {
+                fprintf(stderr,"Failed to read bcl file %s : cluster %d\n", bcl->filename, bcl->current_cluster);
+                exit(1);
+            }
+            // visit the wanted clusters 64 at a time, one bit per cluster
+            for (int w=0, k=0; w < (n + 63) / 64; w++) {
+                uint64_t want = (n - w*64 >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << (n - w*64)) - 1;
+                if (pf_only || skip_filtered) want = tb->pf[w];
+                while (want) {
+                    int c = w*64 + __builtin_ctzll(want);
+                    int cycle = seg->length[c]++;
+                    if (!pf_only) k = c;
+                    seg->bases[c * seg->base_stride + cycle/4] |= base2bits[tb->tmp_bases[k]] << (2 * (cycle & 3));
+                    seg->quals[c * seg->ncycles + cycle] = tb->tmp_quals[k];
+                    k++;
+                    want &= want - 1;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Make room for len more bytes of aux data in the tile buffer
+ */
+static void reserveAux(tileBuffer_t *tb, size_t len)
+{
+    if (tb->aux_len + len > tb->aux_max) {
+        tb->aux_max = (tb->aux_len + len) * 2;
+        tb->aux = realloc(tb->aux, tb->aux_max);
+        if (!tb->aux) {
+            fprintf(stderr,"Failed to allocate aux buffer\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Append len bytes to the aux data being built in the tile buffer
+ */
+static void appendAux(tileBuffer_t *tb, const void *data, size_t len)
+{
+    reserveAux(tb, len);
+    memcpy(tb->aux + tb->aux_len, data, len);
+    tb->aux_len += len;
+}
+
+/*
+ * Append the bases of one cluster in a segment to the aux data as text,
+ * or the qualities (phred+33) if quals is set.
+ */
+static void appendAuxBases(tileBuffer_t *tb, tileSegment_t *seg, int cluster, bool quals)
+{
+    const uint8_t *packed = seg->bases + cluster * seg->base_stride;
+    const uint8_t *q = seg->quals + cluster * seg->ncycles;
+    int len = seg->length[cluster];
+
+    reserveAux(tb, len);
+    char *p = (char *)tb->aux + tb->aux_len;
+    for (int i=0; i < len; i++) {
+        if (quals) p[i] = q[i] + 33;
+        else       p[i] = q[i] ? "ACGT"[(packed[i/4] >> (2 * (i & 3))) & 3] : 'N';
+    }
+    tb->aux_len += len;
+}
+
 /*
  * Tile array
  */
 typedef struct {
     int tile;
     int clusters;
+    int first_cluster;
 } tileIndexEntry_t;
 
+/*
+ * Tile index, with a direct lookup from tile number to entry
+ */
+typedef struct {
+    va_t *tiles;
+    int min_tile;
+    int max_tile;
+    tileIndexEntry_t **lookup;  // lookup[tile-min_tile], or NULL
+} tileIndex_t;
+
 /*
  * structure to hold options
  */
@@ -193,12 +771,25 @@ typedef struct {
     char *intensity_dir;
     char *basecalls_dir;
     int lane;
+    ia_t *lanes;            // all the lanes to convert
     int max_threads;
+    int inflate_threads;
+    int min_split;          // smallest range of clusters a worker will take from another
+    int tile_buffer;        // clusters read at a time, a quarter of min_split up to TILE_BUFFER_CLUSTERS
+    int compression_threads;
+    bool mmap;
     char *output_file;
     char *output_fmt;
     char compression_level;
     bool generate_secondary_basecalls;
     bool no_filter;
+    bool tile_order;
+    int reorder_window;
+    char *live_store;       // if converting cycles as they are written, where to keep them
+    int poll_interval;
+    char *shard_dir;        // if writing each tile to its own BAM file first, where to keep them
+    char *stats_json;       // if collecting statistics, the file to write them to
+    int progress_interval;
     char *read_group_id;
     char *sample_alias;
     char *library_name;
@@ -224,21 +815,99 @@ typedef struct {
 } opts_t;
 
 /*
- * Data to be passed / shared between threads
+ * The kinds of file we read, for counting the bytes read from each
+ */
+enum { STATS_BCL, STATS_SCL, STATS_CBCL, STATS_FILTER, STATS_POS, STATS_NFILES };
+static const char *statsFileType[STATS_NFILES] = { "bcl", "scl", "cbcl", "filter", "pos" };
+
+/*
+ * Where the time went in converting a tile, if --stats-json was given.
+ * A tile split between workers has the times of all its jobs added together.
+ */
+typedef struct {
+    int njobs;
+    double seconds;         // from opening the tile's files to closing them
+    double open;            // opening the files, and skipping to the first cluster of the job
+    double read;            // loading clusters into the tile buffer
+    double inflate;         // inflating CBCL blocks, which is part of open and read
+    double build;           // making records from the tile buffer
+    double wait;            // passing records to the output thread, including waiting for room
+    double write;           // writing records to the shard, if there is one
+    long records;
+    uint64_t bytes[STATS_NFILES];
+} tileStats_t;
+
+/*
+ * A lane being converted, and where its records go
  */
 typedef struct {
-    unsigned int tile;
+    opts_t *opts;           // the options, with the lane number and output file name for this lane
     samFile *output_file;
     bam_hdr_t *output_header;
+    ia_t *tiles;
+    tileIndex_t *tileIndex;
+    queue_t *q;
+    reorder_t *ro;          // if writing in tile order, instead of q
+    recPool_t *pool;        // shared by all the lanes
+    pthread_t output_tid;
+    tileStats_t *stats;     // for each tile, if keeping statistics
+    double output_wait;     // time the output thread spent waiting for records
+    double output_write;    // and writing (and so compressing, unless a thread pool does that) them
+    char *shard_options;    // if writing shards, the @CO line in their headers with the options which change the records
+} lane_t;
+
+/*
+ * A job for a worker thread: a range of clusters in one tile.
+ * pos and end may be read and changed by other workers, with the job_data mutex held.
+ */
+typedef struct {
+    lane_t *lane;
+    int tile_index;         // position of the tile in the lane's tile list
+    int start;              // first cluster
+    int pos;                // next cluster to be read by the worker
+    int end;                // end of the range, or -1 if not known yet. Reduced when the range is split.
+    piece_t *piece;         // where the records go, if writing in tile order
+    samFile *shard;         // or if writing the tile to its own file
+    bam_hdr_t *shard_header;
+} job_t;
+
+struct worker_s;
+
+/*
+ * Data to be passed / shared between threads
+ */
+typedef struct {
     opts_t *opts;
     va_t *cycleRange;
-    va_t *tileIndex;
-    queue_t *q;
-    int *n_threads;
-    int *tiles_left;
-    pthread_mutex_t *n_threads_mutex;
+    va_t *lanes;            // lane_t
+    ia_t *work_lane;        // every tile to be converted: the index of its lane in lanes,
+    ia_t *work_tile;        // and its index in that lane's tile list
+    recPool_t *pool;        // written records, for reuse
+    bclfile_pool_t *inflate_pool;   // threads to inflate CBCL blocks, if any
+    pthread_mutex_t mutex;  // for the workers' tile lists and jobs, and the counts below
+    pthread_cond_t finished;    // signalled when a worker finishes
+    pthread_cond_t job_changed; // signalled when a job's end becomes known, or the job finishes
+    struct worker_s *workers;
+    int nworkers;
+    int nfinished;          // workers which have finished
+    int tiles_started;
+    long records;           // records written so far
 } job_data_t;
 
+/*
+ * A worker thread, and the tiles it has still to start
+ */
+typedef struct worker_s {
+    job_data_t *job_data;
+    int id;
+    ia_t *tiles;            // indexes into the work list, taken from the front and stolen from the back
+    int next_tile;
+    job_t *job;             // the current job
+    int njobs, ntiles_stolen, nsplits;
+    double busy;            // seconds spent on jobs
+    pthread_t tid;
+} worker_t;
+
 
 
 /*
@@ -254,6 +923,9 @@ void i2b_free_opts(opts_t* opts)
     free(opts->argv_list);
     free(opts->output_file);
     free(opts->output_fmt);
+    free(opts->live_store);
+    free(opts->shard_dir);
+    free(opts->stats_json);
     free(opts->read_group_id);
     free(opts->sample_alias);
     free(opts->library_name);
@@ -264,6 +936,7 @@ void i2b_free_opts(opts_t* opts)
     free(opts->platform);
     va_free(opts->barcode_tag);
     va_free(opts->quality_tag);
+    ia_free(opts->lanes);
     ia_free(opts->bc_read);
     ia_free(opts->first_cycle);
     ia_free(opts->final_cycle);
@@ -393,8 +1066,10 @@ static void usage(FILE *write_to)
 "  -b   --basecalls-dir                 Illumina basecalls directory including config xml file, and filter files,\n"
 "                                       bcl, maybe scl files under lane cycle directory\n"
 "                                       [default: BaseCalls directory under intensities]\n"
-"  -l   --lane                          Lane number. Required\n"
+"  -l   --lane                          Lane number, or a comma separated list of lanes. Required\n"
 "  -o   --output-file                   Output file name. May be '-' for stdout. Required\n"
+"                                       %%d in the name is replaced by the lane number. With more than one lane,\n"
+"                                       there is an output file for each lane, and the name must contain %%d\n"
 "       --generate-secondary-basecalls  Including second base call or not [default: false]\n"
 "       --no-filter                     Do not filter cluster [default: false]\n"
 "       --read-group-id                 ID used to link RG header record with RG tag in SAM record. [default: '1']\n"
@@ -425,6 +1100,32 @@ static void usage(FILE *write_to)
 "  -S   --no-index-separator            Do NOT separate dual indexes with a '" INDEX_SEPARATOR "' character. Just concatenate instead.\n"
 "  -v   --verbose                       verbose output\n"
 "  -t   --threads                       maximum number of threads to use [default: 8]\n"
+"       --inflate-threads               number of threads, out of --threads, shared by the workers to read and\n"
+"                                       uncompress the CBCL blocks of each tile as it is opened [default: 0]\n"
+"       --min-split-clusters            smallest range of clusters an idle thread will take from a tile another\n"
+"                                       thread is converting. Clusters are read a quarter of this at a time,\n"
+"                                       up to " xstr(TILE_BUFFER_CLUSTERS) " [default: " MIN_SPLIT_CLUSTERS "]\n"
+"       --compression-threads           number of threads, out of --threads, used to compress the output file\n"
+"                                       [default: a quarter of the threads not used by the main and output threads]\n"
+"       --mmap                          memory map CBCL files instead of reading them [default: false]\n"
+"       --tile-order                    write the records one tile at a time, in tile order, so that the output\n"
+"                                       is the same every time [default: false]\n"
+"       --reorder-window                maximum number of records to hold in memory for tiles waiting to be written\n"
+"                                       with --tile-order. Any more are written to temporary files in $TMPDIR\n"
+"                                       [default: " REORDER_WINDOW "]\n"
+"       --live                          convert the run while it is being sequenced. Each cycle is decoded into the\n"
+"                                       given directory as soon as it has been written, and the BAM file is written\n"
+"                                       after the last cycle. A restarted conversion keeps the cycles already there\n"
+"       --poll-interval                 seconds between checks for new cycles with --live [default: " POLL_INTERVAL "]\n"
+"       --shard-dir                     write each tile to its own BAM file in the given directory, then join them,\n"
+"                                       in tile order, into the output file. A restarted conversion keeps the tiles\n"
+"                                       already there, so the options which change the records (the cycles, tags,\n"
+"                                       filter and read group ID) must be the same: a shard written with different\n"
+"                                       ones is an error. Needs BAM output\n"
+"       --stats-json                    write statistics for each tile (time spent reading, inflating, building\n"
+"                                       records, waiting and writing, and bytes read) to the given JSON file\n"
+"       --progress-interval             seconds between lines on stderr showing how many tiles have been started\n"
+"                                       and records written, or 0 for none [default: " PROGRESS_INTERVAL "]\n"
 "       --output-fmt                    [sam/bam/cram] [default: bam]\n"
 "       --compression-level             [0..9]\n"
 );
@@ -474,6 +1175,17 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         { "final-cycle",                1, 0, 0 },
         { "first-index-cycle",          1, 0, 0 },
         { "final-index-cycle",          1, 0, 0 },
+        { "inflate-threads",            1, 0, 0 },
+        { "min-split-clusters",         1, 0, 0 },
+        { "compression-threads",        1, 0, 0 },
+        { "mmap",                       0, 0, 0 },
+        { "tile-order",                 0, 0, 0 },
+        { "reorder-window",             1, 0, 0 },
+        { "live",                       1, 0, 0 },
+        { "poll-interval",              1, 0, 0 },
+        { "shard-dir",                  1, 0, 0 },
+        { "stats-json",                 1, 0, 0 },
+        { "progress-interval",          1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -483,6 +1195,7 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     opts->argv_list = stringify_argv(argc+1, argv-1);
     if (opts->argv_list[strlen(opts->argv_list)-1] == ' ') opts->argv_list[strlen(opts->argv_list)-1] = 0;
 
+    opts->lanes = ia_init(5);
     opts->bc_read = ia_init(5);
     opts->first_cycle = ia_init(5);
     opts->final_cycle = ia_init(5);
@@ -492,7 +1205,13 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     opts->quality_tag = va_init(5, free);
     opts->separator = true;
     opts->max_threads = DEFAULT_MAX_THREADS;
+    opts->inflate_threads = 0;
+    opts->min_split = atoi(MIN_SPLIT_CLUSTERS);
+    opts->compression_threads = -1;
     opts->qlen = atoi(QUEUELEN);
+    opts->reorder_window = atoi(REORDER_WINDOW);
+    opts->poll_interval = atoi(POLL_INTERVAL);
+    opts->progress_interval = atoi(PROGRESS_INTERVAL);
 
     int opt;
     int option_index = 0;
@@ -507,7 +1226,7 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                     break;
         case 'o':   opts->output_file = strdup(optarg);
                     break;
-        case 'l':   opts->lane = atoi(optarg);
+        case 'l':   parse_int(opts->lanes, optarg);
                     break;
         case 'v':   opts->verbose++;
                     break;
@@ -543,6 +1262,17 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "final-cycle") == 0)                  parse_int(opts->final_cycle,optarg);
                     else if (strcmp(arg, "first-index-cycle") == 0)            parse_int(opts->first_index_cycle,optarg);
                     else if (strcmp(arg, "final-index-cycle") == 0)            parse_int(opts->final_index_cycle,optarg);
+                    else if (strcmp(arg, "inflate-threads") == 0)              opts->inflate_threads = atoi(optarg);
+                    else if (strcmp(arg, "min-split-clusters") == 0)           opts->min_split = atoi(optarg);
+                    else if (strcmp(arg, "compression-threads") == 0)          opts->compression_threads = atoi(optarg);
+                    else if (strcmp(arg, "mmap") == 0)                         opts->mmap = true;
+                    else if (strcmp(arg, "tile-order") == 0)                   opts->tile_order = true;
+                    else if (strcmp(arg, "reorder-window") == 0)               opts->reorder_window = atoi(optarg);
+                    else if (strcmp(arg, "live") == 0)                         opts->live_store = strdup(optarg);
+                    else if (strcmp(arg, "poll-interval") == 0)                opts->poll_interval = atoi(optarg);
+                    else if (strcmp(arg, "shard-dir") == 0)                    opts->shard_dir = strdup(optarg);
+                    else if (strcmp(arg, "stats-json") == 0)                   opts->stats_json = strdup(optarg);
+                    else if (strcmp(arg, "progress-interval") == 0)            opts->progress_interval = atoi(optarg);
                     else {
                         fprintf(stderr,"\nUnknown option: %s\n\n", arg); 
                         usage(stdout); i2b_free_opts(opts);
@@ -567,27 +1297,69 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         usage(stderr); return NULL;
     }
 
-    if (opts->lane <= 0) {
+    if (ia_isEmpty(opts->lanes)) {
         fprintf(stderr,"You must specify a lane number (-l or --lane)\n");
         usage(stderr); return NULL;
     }
 
-    if (opts->lane > 999) {
-        fprintf(stderr,"I can't handle a lane number greater than 999\n");
-        usage(stderr); return NULL;
+    for (int n=0; n < opts->lanes->end; n++) {
+        int lane = opts->lanes->entries[n];
+        if (lane <= 0) {
+            fprintf(stderr,"You must specify a lane number (-l or --lane)\n");
+            usage(stderr); return NULL;
+        }
+        if (lane > 999) {
+            fprintf(stderr,"I can't handle a lane number greater than 999\n");
+            usage(stderr); return NULL;
+        }
+        for (int i=0; i < n; i++) {
+            if (opts->lanes->entries[i] == lane) {
+                fprintf(stderr,"Lane %d is given more than once\n", lane);
+                usage(stderr); return NULL;
+            }
+        }
     }
+    opts->lane = opts->lanes->entries[0];
 
     if (!opts->output_file) {
         fprintf(stderr,"You must specify an output file (-o or --output-file)\n");
         usage(stderr); return NULL;
     }
 
+    if (opts->lanes->end > 1 && !strstr(opts->output_file, "%d")) {
+        fprintf(stderr,"The output file name must contain %%d, for the lane number, when converting more than one lane\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->live_store && opts->generate_secondary_basecalls) {
+        fprintf(stderr,"--live can't be used with --generate-secondary-basecalls\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->poll_interval < 1) opts->poll_interval = 1;
+    if (opts->progress_interval < 0) opts->progress_interval = 0;
+    if (opts->min_split < 1) opts->min_split = 1;
+    opts->tile_buffer = opts->min_split / 4;
+    if (opts->tile_buffer < 1) opts->tile_buffer = 1;
+    if (opts->tile_buffer > TILE_BUFFER_CLUSTERS) opts->tile_buffer = TILE_BUFFER_CLUSTERS;
+
     if (opts->compression_level && !isdigit(opts->compression_level)) {
         fprintf(stderr, "compression-level must be a digit in the range [0..9], not '%c'\n", opts->compression_level);
         usage(stderr); return NULL;
     }
 
-    if (opts->max_threads < 3) opts->max_threads = 3;
+    // there is a main thread, and an output thread for each lane unless the workers write shards
+    int overhead = opts->shard_dir ? 1 : 1 + opts->lanes->end;
+    if (opts->max_threads < overhead + 1) opts->max_threads = overhead + 1;
+    if (opts->inflate_threads < 0) opts->inflate_threads = 0;
+    if (opts->compression_threads < 0) opts->compression_threads = (opts->max_threads - overhead) / 4;
+    // each worker compresses its own shards, and joining them needs no compression
+    if (opts->shard_dir) opts->compression_threads = 0;
+    // leave at least one worker thread
+    if (opts->compression_threads > opts->max_threads - overhead - 1) opts->compression_threads = opts->max_threads - overhead - 1;
+    if (opts->inflate_threads > opts->max_threads - overhead - 1 - opts->compression_threads) {
+        opts->inflate_threads = opts->max_threads - overhead - 1 - opts->compression_threads;
+    }
 
     // Set defaults
     if (!opts->read_group_id) opts->read_group_id = strdup("1");
@@ -638,13 +1410,6 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     if (!opts->run_folder) { perror("run_folder"); return NULL; }
     free(tmp);
 
-    if (!opts->platform_unit) {
-        // default is runfolder + lane
-        char *rf = basename(opts->run_folder);
-        opts->platform_unit = calloc(1, strlen(rf) + 5);
-        sprintf(opts->platform_unit, "%s_%d", rf, opts->lane);
-    }
-
     // read XML files
     opts->intensityConfig = loadXML(opts->intensity_dir, "config.xml", opts->verbose);
     opts->basecallsConfig = loadXML(opts->basecalls_dir, "config.xml", opts->verbose);
@@ -830,28 +1595,51 @@ static char *getId(opts_t *opts)
  * Load the tile index array (the BCI file)
  * This is only for NextSeq 
  */
-static va_t *getTileIndex(opts_t *opts)
+static void freeTileIndex(tileIndex_t *tileIndex)
+{
+    if (!tileIndex) return;
+    va_free(tileIndex->tiles);
+    free(tileIndex->lookup);
+    free(tileIndex);
+}
+
+static tileIndex_t *getTileIndex(opts_t *opts)
 {
-    va_t *tileIndex = NULL;
+    tileIndex_t *tileIndex = NULL;
     char *fname = calloc(1,strlen(opts->basecalls_dir)+64);
     sprintf(fname, "%s/L%03d/s_%d.bci", opts->basecalls_dir, opts->lane, opts->lane);
     int fhandle = open(fname,O_RDONLY);
     if (fhandle < 0) {
         if (opts->verbose) fprintf(stderr,"Can't open BCI file %s\n", fname);
     } else {
-        tileIndex = va_init(100,free);
+        tileIndex = calloc(1, sizeof(tileIndex_t));
+        tileIndex->tiles = va_init(100,free);
         int n;
+        int first_cluster = 0;
         do {
             tileIndexEntry_t *ti = calloc(1, sizeof(tileIndexEntry_t));
             n = read(fhandle, &ti->tile, 4);
             n = read(fhandle, &ti->clusters, 4);
             if (n == 4) {
-                va_push(tileIndex,ti);
+                ti->first_cluster = first_cluster;
+                first_cluster += ti->clusters;
+                if (tileIndex->tiles->end == 0 || ti->tile < tileIndex->min_tile) tileIndex->min_tile = ti->tile;
+                if (tileIndex->tiles->end == 0 || ti->tile > tileIndex->max_tile) tileIndex->max_tile = ti->tile;
+                va_push(tileIndex->tiles,ti);
             } else {
                 free(ti);
             }
         } while (n == 4);
         close(fhandle);
+
+        // build the tile number lookup. If a tile appears twice, the first one wins
+        if (tileIndex->tiles->end) {
+            tileIndex->lookup = calloc(tileIndex->max_tile - tileIndex->min_tile + 1, sizeof(tileIndexEntry_t *));
+            for (n = tileIndex->tiles->end - 1; n >= 0; n--) {
+                tileIndexEntry_t *ti = tileIndex->tiles->entries[n];
+                tileIndex->lookup[ti->tile - tileIndex->min_tile] = ti;
+            }
+        }
     }
     free(fname);
     return tileIndex;
@@ -889,7 +1677,8 @@ static ia_t *getTileList(opts_t *opts)
         }
         if (ptr && ptr->nodesetval) {
             for (int n=0; n < ptr->nodesetval->nodeNr; n++) {
-                char *t = (char *)ptr->nodesetval->nodeTab[n]->children->content;
+                // copy the tile name, so that the document can be read again for another lane
+                char *t = strdup((char *)ptr->nodesetval->nodeTab[n]->children->content);
                 char *saveptr;
                 char *lane = strtok_r(t, "_", &saveptr);
                 char *tileno = strtok_r(NULL, "_", &saveptr);
@@ -898,6 +1687,7 @@ static ia_t *getTileList(opts_t *opts)
                         ia_push(tiles,atoi(tileno));
                     }
                 }
+                free(t);
             }
             xmlXPathFreeObject(ptr);
         }
@@ -1083,26 +1873,24 @@ static va_t *getCycleRange(opts_t *opts)
  * Find cluster number for a given tile
  * Abort if tile not found
  */
-static int findClusterNumber(int tile, va_t *tileIndex)
+static tileIndexEntry_t *findTile(int tile, tileIndex_t *tileIndex)
 {
-    int clusterNumber = 0;
-    for (int n=0; n < tileIndex->end; n++) {
-        tileIndexEntry_t *ti = (tileIndexEntry_t *)tileIndex->entries[n];
-        if (ti->tile == tile)
-            return clusterNumber;
-        clusterNumber += ti->clusters;
-    }
+    if (tile < tileIndex->min_tile || tile > tileIndex->max_tile) return NULL;
+    return tileIndex->lookup[tile - tileIndex->min_tile];
+}
+
+static int findClusterNumber(int tile, tileIndex_t *tileIndex)
+{
+    tileIndexEntry_t *ti = findTile(tile, tileIndex);
+    if (ti) return ti->first_cluster;
     fprintf(stderr,"findClusterNumber(%d) : no such tile\n", tile);
     exit(1);
 }
 
-static int findClusters(int tile, va_t *tileIndex)
+static int findClusters(int tile, tileIndex_t *tileIndex)
 {
-    for (int n=0; n < tileIndex->end; n++) {
-        tileIndexEntry_t *ti = (tileIndexEntry_t *)tileIndex->entries[n];
-        if (ti->tile == tile)
-            return ti->clusters;
-    }
+    tileIndexEntry_t *ti = findTile(tile, tileIndex);
+    if (ti) return ti->clusters;
     fprintf(stderr,"findClusters(%d) : no such tile\n", tile);
     exit(1);
 }
@@ -1115,7 +1903,7 @@ static int findClusters(int tile, va_t *tileIndex)
  * Open and return the first one found, or NULL if not found.
  */
 
-static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
+static posfile_t *openPositionFile(int tile, tileIndex_t *tileIndex, opts_t *opts)
 {
     posfile_t *posfile = NULL;
 
@@ -1133,19 +1921,19 @@ static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
     if (posfile->errmsg) {
         posfile_close(posfile);
         sprintf(fname, "%s/s.locs", opts->intensity_dir);
-        posfile = posfile_open(fname);
+        posfile = posfile_open_shared(fname);
     }
 
     // if still not found, try NewSeq format files
     if (posfile->errmsg) {
         posfile_close(posfile);
         sprintf(fname, "%s/L%03d/s_%d.clocs", opts->intensity_dir, opts->lane, opts->lane);
-        posfile = posfile_open(fname);
+        posfile = posfile_open_shared(fname);
 
         if (posfile->errmsg) {
             posfile_close(posfile);
             sprintf(fname, "%s/L%03d/s_%d.locs", opts->intensity_dir, opts->lane, opts->lane);
-            posfile = posfile_open(fname);
+            posfile = posfile_open_shared(fname);
         }
 
         if (!posfile->errmsg) {
@@ -1170,7 +1958,7 @@ static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
 /*
  * find and open the filter file
  */
-static filter_t *openFilterFile(int tile, va_t *tileIndex, opts_t *opts)
+static filter_t *openFilterFile(int tile, tileIndex_t *tileIndex, opts_t *opts)
 {
     filter_t *filter = NULL;
     char *fname = calloc(1,strlen(opts->basecalls_dir)+128); // a bit arbitrary :-(
@@ -1185,7 +1973,7 @@ static filter_t *openFilterFile(int tile, va_t *tileIndex, opts_t *opts)
     if (filter->errmsg) {
         filter_close(filter);
         sprintf(fname, "%s/L%03d/s_%d.filter", opts->basecalls_dir, opts->lane, opts->lane);
-        filter = filter_open(fname);
+        filter = filter_open_shared(fname);
     }
 
     if (opts->verbose && !filter->errmsg) fprintf(stderr,"Opened filter file %s\n", fname);
@@ -1198,146 +1986,435 @@ static filter_t *openFilterFile(int tile, va_t *tileIndex, opts_t *opts)
 
 /*
  * Open a single bcl (or scl) file
+ * Returns NULL if it can't be found, with the last name tried in fname
  */
-static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, int surface, char *ext, va_t *tileIndex)
+static bclfile_t *findBclFile(char *fname, char *basecalls, int lane, int tile, int cycle, int surface, char *ext, tileIndex_t *tileIndex)
 {
-    bclfile_t *bcl;
-    char *fname = calloc(1, strlen(basecalls)+128);
+    bclfile_t *bcl = NULL;
 
     // NextSeq format
     if (machineType==-1 || machineType==1) {
         sprintf(fname, "%s/L%03d/%04d.%s", basecalls, lane, cycle, ext);
         bcl = bclfile_open(fname);
-        if (bcl->errmsg) { bclfile_close(bcl); bcl=NULL; }
-        else             { machineType = 1; }
+        if (bcl && bcl->errmsg) { bclfile_close(bcl); bcl = NULL; }
+        if (bcl) machineType = 1;
     }
 
     // NovaSeq format
     if (machineType==-1 || machineType==2) {
         sprintf(fname, "%s/L%03d/C%d.1/L%03d_%d.cbcl", basecalls, lane, cycle, lane, surface);
         bcl = bclfile_open(fname);
-        if (bcl->errmsg) { bclfile_close(bcl); bcl = NULL; }
-        else             { machineType = 2; }
+        if (bcl && bcl->errmsg) { bclfile_close(bcl); bcl = NULL; }
+        if (bcl) machineType = 2;
     }
 
     // other formats
     if (machineType==-1 || machineType==3) {
         sprintf(fname, "%s/L%03d/C%d.1/s_%d_%04d.%s", basecalls, lane, cycle, lane, tile, ext);
         bcl = bclfile_open(fname);
-        if (bcl->errmsg) { bclfile_close(bcl); bcl = NULL; }
-        else             { machineType = 3; }
+        if (bcl && bcl->errmsg) { bclfile_close(bcl); bcl = NULL; }
+        if (bcl) machineType = 3;
     }
 
+    if (!bcl) return NULL;
+
+    bcl->surface = surface;
+    if (tileIndex) bclfile_seek(bcl, findClusterNumber(tile,tileIndex));
+
+    return bcl;
+}
+
+static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, int surface, char *ext, tileIndex_t *tileIndex)
+{
+    char *fname = calloc(1, strlen(basecalls)+128);
+    bclfile_t *bcl = findBclFile(fname, basecalls, lane, tile, cycle, surface, ext, tileIndex);
+
     if (!bcl) {
         fprintf(stderr,"Can't open BCL file %s\n", fname);
         exit(1);
     }
 
     free(fname);
-
-    bcl->surface = surface;
-    if (tileIndex) bclfile_seek(bcl, findClusterNumber(tile,tileIndex));
-    if (bcl->file_type == BCL_CBCL) bclfile_seek_tile(bcl, tile);
-
     return bcl;
 }
 
 /*
- * Find and open all the relevant bcl and scl files
- * Looking at the file type is also the only way to find out if we are on a NovaSeq system
+ * Live conversion.
+ * Each cycle of each tile is decoded, as soon as the instrument has finished writing it,
+ * into a plain bcl file in the live store: <store>/L<lane>/C<cycle>.1/s_<lane>_<tile>.bcl
+ * These hold every cluster of the tile, whatever the format of the original files, and
+ * are renamed into place once written, so any which exist after a restart are complete.
  */
-static va_t *openBclFiles(va_t *cycleRange, opts_t *opts, int tile, va_t *tileIndex, bool *novaSeq, filter_t *filter)
+static char *liveFileName(opts_t *opts, int tile, int cycle)
 {
-    va_t *bclReadArray = va_init(5,freeBCLReadArray);
-    *novaSeq = false;
+    char *fname = malloc(strlen(opts->live_store) + 64);
+    if (!fname) { fprintf(stderr,"Can't allocate memory for file name\n"); exit(1); }
+    sprintf(fname, "%s/L%03d/C%d.1/s_%d_%04d.bcl", opts->live_store, opts->lane, cycle, opts->lane, tile);
+    return fname;
+}
 
-    for (int n=0; n < cycleRange->end; n++) {
-        cycleRangeEntry_t *cr = cycleRange->entries[n];
-        bclReadArrayEntry_t *ra = calloc(1, sizeof(bclReadArrayEntry_t));
+static bclfile_t *openLiveFile(opts_t *opts, int tile, int cycle)
+{
+    char *fname = liveFileName(opts, tile, cycle);
+    bclfile_t *bcl = bclfile_open(fname);
+    if (!bcl || bcl->errmsg) {
+        fprintf(stderr,"Can't open BCL file %s\n", fname);
+        exit(1);
+    }
+    bcl->surface = bcl_tile2surface(tile);
+    free(fname);
+    return bcl;
+}
+
+/*
+ * Make the directory holding fname, and any above it
+ */
+static void makeParentDir(char *fname)
+{
+    char *dir = strdup(fname);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = 0;
+        if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+            fprintf(stderr,"Can't create directory %s: %s\n", dir, strerror(errno));
+            exit(1);
+        }
+        *p = '/';
+    }
+    free(dir);
+}
+
+/*
+ * Read all n clusters of a tile from a bcl or cbcl file, and encode them as bcl bytes.
+ * CBCL files with the pfFlag set only hold the clusters which passed the filter, so the
+ * others are filled in as no-calls.
+ * Returns false if the file, or the filter file it needs, is not complete.
+ */
+static bool readLiveCycle(bclfile_t *bcl, filter_t *filter, int n, uint8_t *out)
+{
+    static const uint8_t base2bits[256] = { ['C'] = 1, ['G'] = 2, ['T'] = 3 };
+    uint8_t *bases = malloc(n ? n : 1);
+    uint8_t *quals = malloc(n ? n : 1);
+    uint64_t *pf = NULL;
+    bool pf_only = bcl->file_type == BCL_CBCL && bcl->pfFlag;
+    int count = n;
+    bool ok = true;
+
+    if (!bases || !quals) { fprintf(stderr,"Can't allocate memory for live conversion\n"); exit(1); }
+    if (pf_only) {
+        pf = calloc((n + 63) / 64 + 1, sizeof(uint64_t));
+        if (!pf) { fprintf(stderr,"Can't allocate memory for live conversion\n"); exit(1); }
+        // a short filter file is still being written, and would leave clusters out of the store for good
+        if (filter_load_tile(filter, pf, n) != n) ok = false;
+        count = 0;
+        for (int w=0; w < (n + 63) / 64; w++) count += __builtin_popcountll(pf[w]);
+    }
+
+    for (int got = 0; ok && got < count; ) {
+        int r = bclfile_load_tile(bcl, bases + got, quals + got, count - got);
+        if (r <= 0) ok = false;
+        else        got += r;
+    }
+
+    for (int c=0, k=0; ok && c < n; c++) {
+        if (pf_only && !((pf[c / 64] >> (c % 64)) & 1)) {
+            out[c] = 0;
+            continue;
+        }
+        uint8_t q = quals[k] > 63 ? 63 : quals[k];
+        out[c] = q ? (q << 2) | base2bits[bases[k]] : 0;
+        k++;
+    }
+
+    free(bases);
+    free(quals);
+    free(pf);
+    return ok;
+}
+
+/*
+ * Copy one cycle of a tile into the live store, if the instrument has finished writing it.
+ * Returns true if it is in the store.
+ */
+static bool storeLiveCycle(opts_t *opts, int tile, tileIndex_t *tileIndex, int cycle)
+{
+    char *fname = liveFileName(opts, tile, cycle);
+    bool done = access(fname, F_OK) == 0;
+
+    if (!done) {
+        char *bclname = calloc(1, strlen(opts->basecalls_dir)+128);
+        bclfile_t *bcl = findBclFile(bclname, opts->basecalls_dir, opts->lane, tile, cycle, bcl_tile2surface(tile), "bcl", tileIndex);
+        filter_t *filter = NULL;
+        int n = -1;
+
+        if (bcl && bcl->file_type == BCL_CBCL) {
+            // the number of clusters comes from the filter file
+            filter = openFilterFile(tile, tileIndex, opts);
+            if (!filter->errmsg && bclfile_seek_tile(bcl, tile) >= 0) n = filter->total_clusters;
+        } else if (bcl) {
+            n = tileIndex ? findClusters(tile, tileIndex) : bcl->total_clusters;
+        }
+
+        uint8_t *out = malloc(n > 0 ? n : 1);
+        if (!out) { fprintf(stderr,"Can't allocate memory for live conversion\n"); exit(1); }
+        if (n >= 0 && readLiveCycle(bcl, filter, n, out)) {
+            char *tmpname = malloc(strlen(fname) + 8);
+            sprintf(tmpname, "%s.tmp", fname);
+            makeParentDir(fname);
+            FILE *fp = fopen(tmpname, "w");
+            uint32_t nclusters = n;
+            if (!fp || fwrite(&nclusters, sizeof(nclusters), 1, fp) != 1 ||
+                fwrite(out, 1, n, fp) != n || fclose(fp) != 0 || rename(tmpname, fname) != 0) {
+                fprintf(stderr,"Can't write %s: %s\n", fname, strerror(errno));
+                exit(1);
+            }
+            if (opts->verbose) fprintf(stderr,"Stored cycle %d of lane %d tile %d\n", cycle, opts->lane, tile);
+            free(tmpname);
+            done = true;
+        }
+
+        free(out);
+        if (filter) filter_close(filter);
+        if (bcl) bclfile_close(bcl);
+        free(bclname);
+    }
+
+    free(fname);
+    return done;
+}
+
+/*
+ * Wait for something to be written under the basecalls directory, or for the poll interval to pass.
+ * Returns false if the run had already finished before we started waiting.
+ */
+static bool liveWait(opts_t *opts, int notify_fd)
+{
+    char *fname = malloc(strlen(opts->run_folder) + 32);
+    sprintf(fname, "%s/RTAComplete.txt", opts->run_folder);
+    bool finished = access(fname, F_OK) == 0;
+    free(fname);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notify_fd >= 0) {
+        struct pollfd pfd = { notify_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, opts->poll_interval * 1000) > 0) {
+            char buf[4096];
+            while (read(notify_fd, buf, sizeof(buf)) > 0) ;
+        }
+        return !finished;
+    }
+#endif
+    sleep(opts->poll_interval);
+    return !finished;
+}
+
+/*
+ * Watch a directory for files being written, if we can
+ */
+static int liveWatch(int notify_fd, char *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notify_fd >= 0) return inotify_add_watch(notify_fd, dir, IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+    return -1;
+}
+
+/*
+ * Decode every cycle of every tile of every lane into the live store, in cycle order,
+ * waiting for the instrument to write each one.
+ * Gives up if a cycle is still missing one poll interval after the run has finished.
+ * Returns 0 when everything is in the store, or 1 on failure
+ */
+static int liveStore(va_t *lanes, opts_t *opts)
+{
+    va_t *cycleRange = getCycleRange(opts);
+    ia_t *cycles = ia_init(100);
+    ia_t **tiles = calloc(lanes->end, sizeof(ia_t *));
+    tileIndex_t **tileIndex = calloc(lanes->end, sizeof(tileIndex_t *));
+    int notify_fd = -1;
+    int retcode = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    notify_fd = inotify_init1(IN_NONBLOCK);
+    if (notify_fd < 0 && opts->verbose) fprintf(stderr,"Can't use inotify, polling every %d seconds instead\n", opts->poll_interval);
+#endif
+
+    for (int n=0; n < cycleRange->end; n++) {
+        cycleRangeEntry_t *cr = cycleRange->entries[n];
+        for (int cycle = cr->first; cycle <= cr->last; cycle++) ia_push(cycles, cycle);
+    }
+    ia_sort(cycles);
+
+    for (int n=0; n < lanes->end; n++) {
+        lane_t *lane = lanes->entries[n];
+        char *dir = malloc(strlen(opts->basecalls_dir) + 16);
+        sprintf(dir, "%s/L%03d", opts->basecalls_dir, lane->opts->lane);
+        liveWatch(notify_fd, dir);
+        free(dir);
+    }
+
+    for (int c=0; c < cycles->end && !retcode; c++) {
+        int cycle = cycles->entries[c];
+        if (c && cycle == cycles->entries[c-1]) continue;
+        for (int n=0; n < lanes->end && !retcode; n++) {
+            lane_t *lane = lanes->entries[n];
+            if (!tiles[n]) {
+                // the tile layout may only be complete once the run has started
+                tiles[n] = getTileList(lane->opts);
+                tileIndex[n] = getTileIndex(lane->opts);
+            }
+            char *dir = malloc(strlen(opts->basecalls_dir) + 32);
+            sprintf(dir, "%s/L%03d/C%d.1", opts->basecalls_dir, lane->opts->lane, cycle);
+            int wd = -1;
+            for (int t=0; t < tiles[n]->end && !retcode; t++) {
+                int tile = tiles[n]->entries[t];
+                bool running = true;
+                while (!storeLiveCycle(lane->opts, tile, tileIndex[n], cycle)) {
+                    if (!running) {
+                        fprintf(stderr,"The run has finished, but cycle %d of lane %d tile %d can't be read\n", cycle, lane->opts->lane, tile);
+                        retcode = 1;
+                        break;
+                    }
+                    if (wd < 0) wd = liveWatch(notify_fd, dir);
+                    running = liveWait(opts, notify_fd);
+                }
+            }
+#ifdef HAVE_SYS_INOTIFY_H
+            if (wd >= 0) inotify_rm_watch(notify_fd, wd);
+#endif
+            free(dir);
+        }
+        if (opts->verbose && !retcode) fprintf(stderr,"Cycle %d is complete\n", cycle);
+    }
+
+    if (notify_fd >= 0) close(notify_fd);
+    for (int n=0; n < lanes->end; n++) {
+        if (tiles[n]) ia_free(tiles[n]);
+        freeTileIndex(tileIndex[n]);
+    }
+    free(tiles);
+    free(tileIndex);
+    ia_free(cycles);
+    va_free(cycleRange);
+    return retcode;
+}
+
+/*
+ * Find and open all the relevant bcl and scl files
+ * Looking at the file type is also the only way to find out if we are on a NovaSeq system
+ * CBCL files are positioned at the tile once they are all open, so that the
+ * blocks can be read and uncompressed in parallel
+ */
+static va_t *openBclFiles(va_t *cycleRange, opts_t *opts, int tile, tileIndex_t *tileIndex, bool *novaSeq, filter_t *filter, bclfile_pool_t *inflate_pool)
+{
+    va_t *bclReadArray = va_init(5,freeBCLReadArray);
+    int surface = bcl_tile2surface(tile);
+    *novaSeq = false;
+
+    for (int n=0; n < cycleRange->end; n++) {
+        cycleRangeEntry_t *cr = cycleRange->entries[n];
+        bclReadArrayEntry_t *ra = calloc(1, sizeof(bclReadArrayEntry_t));
         ra->readname = strdup(cr->readname);
         int nCycles = cr->last - cr->first + 1;
         ra->bclFileArray = va_init(nCycles, freeBCLFileArray);
         ra->sclFileArray = va_init(nCycles, freeBCLFileArray);
 
         for (int cycle = cr->first; cycle <= cr->last; cycle++) {
-            bclfile_t *bcl = openBclFile(opts->basecalls_dir, opts->lane, tile, cycle, 1, "bcl", tileIndex);
+            if (opts->live_store) {
+                va_push(ra->bclFileArray, openLiveFile(opts, tile, cycle));
+                continue;
+            }
+            // a CBCL file holds the tiles of one surface, so only open the one with this tile in it
+            bclfile_t *bcl = openBclFile(opts->basecalls_dir, opts->lane, tile, cycle, surface, "bcl", tileIndex);
             if (bcl->file_type == BCL_CBCL) *novaSeq = true;
             va_push(ra->bclFileArray, bcl);
 
-            if (novaSeq) {
-                bclfile_t *bcl = openBclFile(opts->basecalls_dir, opts->lane, tile, cycle, 2, "bcl", tileIndex);
-                va_push(ra->bclFileArray, bcl);
-            }
-
             if (opts->generate_secondary_basecalls) {
-                bclfile_t *bcl = openBclFile(opts->basecalls_dir, opts->lane, tile, cycle, 1, "scl", tileIndex);
+                bclfile_t *bcl = openBclFile(opts->basecalls_dir, opts->lane, tile, cycle, surface, "scl", tileIndex);
                 va_push(ra->sclFileArray, bcl);
             }
         }
         va_push(bclReadArray,ra);
     }
 
+    if (*novaSeq) {
+        va_t *cbcls = va_init(500, NULL);
+        for (int n=0; n < bclReadArray->end; n++) {
+            bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+            for (int i=0; i < ra->bclFileArray->end; i++) va_push(cbcls, ra->bclFileArray->entries[i]);
+        }
+        bclfile_seek_tiles(cbcls, tile, inflate_pool);
+        va_free(cbcls);
+    }
+
     return bclReadArray;
 }
 
 /*
- * calculate and return the readname
+ * Write the constant start of a tile's read names, "id:lane:tile:", into readName,
+ * which must have room for READ_NAME_BUFFER characters. Returns its length.
  */
-static char *getReadName(char *id, int lane, int tile, int x, int y)
+static int readNamePrefix(char *readName, char *id, int lane, int tile)
 {
-    char *readName = calloc(1, 128);
+    int len;
 
     if (id && *id) {
-        sprintf(readName, "%s:%d:%d:%d:%d", id, lane, tile, x, y);
+        len = snprintf(readName, 128, "%s:%d:%d:", id, lane, tile);
     } else {
-        sprintf(readName, "%d:%d:%d:%d", lane, tile, x, y);
+        len = snprintf(readName, 128, "%d:%d:", lane, tile);
     }
-    if (strlen(readName) > 127) {
+    if (len > 127) {
         fprintf(stderr,"readName too long: %s\n", readName);
         exit(1);
     }
-    return readName;
+    return len;
 }
 
-static bool readArrayContains(va_t *bclReadArray, char *readname)
+/*
+ * Write a number in decimal at cp, and return the end of it
+ */
+static char *appendNumber(char *cp, int i)
 {
-    for (int n=0; n < bclReadArray->end; n++) {
-        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
-        if (strcmp(readname, ra->readname) == 0) return true;
-    }
-    return false;
+    char digits[12];
+    int n = 0;
+    unsigned int u = i;
+
+    if (i < 0) {
+        *cp++ = '-';
+        u = -u;
+    }
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n) *cp++ = digits[--n];
+    return cp;
 }
 
 /*
- * read all the bases and qualities for a given read name ("read1" or "read2")
+ * Complete a read name by writing the cluster's position after the prefix.
+ * Returns the length of the name.
  */
-static void getBases(va_t *bclReadArray, char *readname, va_t *bases, va_t *qualities, bool convert_qual, bool filtered, int surface)
+static int getReadName(char *readName, int prefix_len, int x, int y)
+{
+    char *p = appendNumber(readName + prefix_len, x);
+    *p++ = ':';
+    p = appendNumber(p, y);
+    *p = 0;
+    if (p - readName > 127) {
+        fprintf(stderr,"readName too long: %s\n", readName);
+        exit(1);
+    }
+    return p - readName;
+}
+
+static bool readArrayContains(va_t *bclReadArray, char *readname)
 {
-    int cycle=0;
     for (int n=0; n < bclReadArray->end; n++) {
         bclReadArrayEntry_t *ra = bclReadArray->entries[n];
-        if (strcmp(ra->readname, readname) == 0) {
-            char *b = calloc(1, ra->bclFileArray->end+1);
-            char *q = calloc(1, ra->bclFileArray->end+1);
-            cycle = 0;
-            for (int i=0; i < ra->bclFileArray->end; i++) {
-                bclfile_t *bcl = ra->bclFileArray->entries[i];
-                if (bcl->surface == surface) {    // ignore if this tile is not in this bcl file
-                    if (filtered && (bcl->file_type == BCL_CBCL) && bcl->pfFlag) continue;
-                    if (bclfile_next(bcl) < 0) {
-                        fprintf(stderr,"Failed to read bcl file %s : cluster %d\n", bcl->filename, bcl->current_cluster);
-                        exit(1);
-                    }
-                    b[cycle] = bcl->base;
-                    q[cycle] = bcl->quality + (convert_qual ? 33 : 0);
-                    cycle++;
-                }
-            }
-            va_push(bases,b);
-            va_push(qualities,q);
-            break;
-        }
+        if (strcmp(readname, ra->readname) == 0) return true;
     }
+    return false;
 }
 
 /*
@@ -1359,298 +2436,1119 @@ static int setFlag(bool second, bool filtered, bool ispaired)
 }
 
 /*
- * Add an aux tag to a BAM record, if it doesn't already exist
- * If it does, concatenate it to the existing tag data
+ * Build the aux data for one cluster in the tile buffer: the read group,
+ * then a Z tag for each distinct barcode and quality tag, in order of first
+ * appearance. Where several indexes share a tag, their values are concatenated.
  */
-static void update_aux(bam1_t *bam, char *auxtag, char *data, char *tag_separator)
+static void makeAux(opts_t *opts, tileBuffer_t *tb, int cluster, va_t *indexes)
 {
-    uint8_t *s = bam_aux_get(bam,auxtag);
-    if (s) {
-        // update existing tag
-        char *new_data = calloc(1, strlen(bam_aux2Z(s)) + (tag_separator ? strlen(tag_separator) : 0) + strlen(data) + 4);
-        strcpy(new_data, bam_aux2Z(s));
-        if (tag_separator) strcat(new_data, tag_separator);
-        strcat(new_data, data);
-        bam_aux_update_str(bam, auxtag, strlen(new_data)+1, new_data);
-        free(new_data);
-    } else {
-        // add new tag
-        bam_aux_append(bam, auxtag, 'Z', strlen(data)+1, (uint8_t *)data);
+    tb->aux_len = 0;
+    appendAux(tb, "RGZ", 3);
+    appendAux(tb, opts->read_group_id, strlen(opts->read_group_id)+1);
+
+    if (indexes->end > opts->barcode_tag->end) {
+        fprintf(stderr, "Not enough barcode tags. This is probably a dual index run with only one barcode tag specified\n");
+        exit(1);
+    }
+
+    // tags are taken in the order barcode_tag[0], quality_tag[0], barcode_tag[1], ...
+    int ntags = indexes->end * 2;
+    for (int k=0; k < ntags; k++) {
+        char *tag = (k & 1) ? opts->quality_tag->entries[k/2] : opts->barcode_tag->entries[k/2];
+        bool seen = false;
+        for (int j=0; j < k && !seen; j++) {
+            char *t = (j & 1) ? opts->quality_tag->entries[j/2] : opts->barcode_tag->entries[j/2];
+            seen = (strcmp(t, tag) == 0);
+        }
+        if (seen) continue;
+
+        appendAux(tb, tag, 2);
+        appendAux(tb, "Z", 1);
+        for (int j=k; j < ntags; j++) {
+            char *t = (j & 1) ? opts->quality_tag->entries[j/2] : opts->barcode_tag->entries[j/2];
+            if (strcmp(t, tag)) continue;
+            if (j > k && opts->separator) {
+                char *sep = (j & 1) ? QUAL_SEPARATOR : INDEX_SEPARATOR;
+                appendAux(tb, sep, strlen(sep));
+            }
+            appendAuxBases(tb, indexes->entries[j/2], cluster, j & 1);
+        }
+        appendAux(tb, "", 1);
     }
 }
 
 /*
- * Create a BAM record
+ * Fill in bam with a record for one cluster in the tile buffer, from the given
+ * read segment and index segments.
+ * The size of the record is known before anything is written, so the data only
+ * needs to be grown once, if at all, and the name, sequence, qualities and tags
+ * are written straight into it.
  */
-static bam1_t *makeRecord(int flags, opts_t *opts, char *readName, 
-                 char *bases, char *qualities, va_t *ib, va_t *iq,
-                 samFile *output_file, bam_hdr_t *output_header)
+static void makeRecord(bam1_t *bam, int flags, opts_t *opts, char *readName, int name_len,
+                 tileBuffer_t *tb, int cluster, tileSegment_t *read, va_t *indexes)
 {
-    bam1_t *bam = bam_init1();
+    static const uint8_t nt16[4] = { 1, 2, 4, 8 };     // A, C, G, T
+    const uint8_t *packed = read->bases + cluster * read->base_stride;
+    const uint8_t *quals = read->quals + cluster * read->ncycles;
+    int len = read->length[cluster];
+    int l_qname = name_len + 1;
+
+    makeAux(opts, tb, cluster, indexes);
+
+    int l_data = l_qname + (len+1)/2 + len + tb->aux_len;
+    if (bam->m_data < l_data) {
+        bam->m_data = l_data;
+        bam->data = realloc(bam->data, bam->m_data);
+        if (!bam->data) {
+            fprintf(stderr,"Failed to allocate BAM record\n");
+            exit(1);
+        }
+    }
+    bam->l_data = l_data;
+
+    bam1_core_t *c = &bam->core;
+    c->tid = -1;
+    c->pos = -1;
+    c->bin = hts_reg2bin(-1, 0, 14, 5);
+    c->qual = 0;
+    c->l_qname = l_qname;
+    c->flag = flags;
+    c->n_cigar = 0;
+    c->l_qseq = len;
+    c->mtid = -1;
+    c->mpos = -1;
+    c->isize = 0;
+
+    uint8_t *p = bam->data;
+    memcpy(p, readName, l_qname);
+    p += l_qname;
+
+    // a base with a quality of zero is an 'N' (15)
+    memset(p, 0, (len+1)/2);
+    for (int i=0; i < len; i++) {
+        uint8_t b = quals[i] ? nt16[(packed[i/4] >> (2 * (i & 3))) & 3] : 15;
+        p[i/2] |= (i & 1) ? b : b << 4;
+    }
+    p += (len+1)/2;
+
+    memcpy(p, quals, len);
+    p += len;
+
+    memcpy(p, tb->aux, tb->aux_len);
+}
 
-    int r = bam_construct_seq(&bam, 0, readName, strlen(readName),
-                                flags, -1, 0, 0, 0, 0, (uint32_t*)"", -1, 0, 0, strlen(bases), bases, qualities);
-    if (r < 0) {
-        fprintf(stderr,"bam_construct_seq() failed\n");
+/*
+ * Return a record to build into, from the spares taken from the pool.
+ * When there are none left, take another batch from the pool, or make a new record if it is empty.
+ */
+static bam1_t *getRecord(recPool_t *pool, bam1_t **spare, int *nspare)
+{
+    if (*nspare == 0) *nspare = rp_get(pool, spare, Q_BATCH);
+    if (*nspare) return spare[--*nspare];
+    bam1_t *rec = bam_init1();
+    if (!rec) { fprintf(stderr,"Failed to allocate BAM record\n"); exit(1); }
+    return rec;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Add the time since *timer to *total, and restart the timer.
+ * timer is NULL when we are not keeping statistics, so that it costs nothing.
+ */
+static void lap(struct timespec *timer, double *total)
+{
+    struct timespec now;
+    if (!timer) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *total += (now.tv_sec - timer->tv_sec) + (now.tv_nsec - timer->tv_nsec) / 1e9;
+    *timer = now;
+}
+
+static void writeRecord(lane_t *lane, bam1_t *rec)
+{
+    int r = sam_write1(lane->output_file, lane->output_header, rec);
+    if (r <= 0) {
+        fprintf(stderr, "Problem writing record %s  : r=%d\n", bam_get_qname(rec),r);
         exit(1);
     }
+}
 
-    // add read group
-    bam_aux_append(bam, "RG", 'Z', strlen(opts->read_group_id)+1, (uint8_t *)opts->read_group_id);
+/*
+ * Read a lane's records from its queue and write them to its BAM file.
+ * Exit when the queue is empty AND there are no more input threads running.
+ * If we are writing in tile order, read each piece of each tile from the reorder buffer in turn instead.
+ */
+static void *output_thread(void *arg)
+{
+    int n;
+    bam1_t *recs[Q_BATCH];
+    lane_t *lane = (lane_t *)arg;
+    opts_t *opts = lane->opts;
+    reorder_t *ro = lane->ro;
+    struct timespec t, *timer = opts->stats_json ? &t : NULL;
+    
+    if (opts->verbose) fprintf(stderr,"Started output thread for lane %d\n", opts->lane);
+    if (timer) clock_gettime(CLOCK_MONOTONIC, timer);
+
+    if (ro) {
+        for (int idx=0; idx < ro->ntiles; idx++) {
+            piece_t *piece;
+            FILE *spill;
+            int start = 0;
+            while ((piece = ro_start(ro, idx, start, &spill)) != NULL) {
+                lap(timer, &lane->output_wait);
+                if (spill) {
+                    bam1_t *rec = bam_init1();
+                    while (unspillRecord(spill, rec)) writeRecord(lane, rec);
+                    rp_put(lane->pool, &rec, 1);
+                    fclose(spill);
+                    lap(timer, &lane->output_write);
+                }
+                while ((n = ro_pop(ro, recs, Q_BATCH)) > 0) {
+                    lap(timer, &lane->output_wait);
+                    for (int i=0; i < n; i++) writeRecord(lane, recs[i]);
+                    rp_put(lane->pool, recs, n);
+                    lap(timer, &lane->output_write);
+                }
+                lap(timer, &lane->output_wait);
+                start = piece->end;
+                ro_finish(ro, idx, piece);
+            }
+        }
+        return NULL;
+    }
 
-    if (ib->end > opts->barcode_tag->end) {
-        fprintf(stderr, "Not enough barcode tags. This is probably a dual index run with only one barcode tag specified\n");
+    while ((n = q_pop(lane->q, recs, Q_BATCH)) > 0) {
+        lap(timer, &lane->output_wait);
+        for (int i=0; i < n; i++) writeRecord(lane, recs[i]);
+        rp_put(lane->pool, recs, n);
+        lap(timer, &lane->output_write);
+    }
+    lap(timer, &lane->output_wait);
+    return NULL;
+}
+
+static void pushRecords(job_t *job, bam1_t **recs, int n)
+{
+    if (job->shard) {
+        for (int i=0; i < n; i++) {
+            int r = sam_write1(job->shard, job->shard_header, recs[i]);
+            if (r <= 0) {
+                fprintf(stderr, "Problem writing record %s  : r=%d\n", bam_get_qname(recs[i]),r);
+                exit(1);
+            }
+        }
+        rp_put(job->lane->pool, recs, n);
+    }
+    else if (job->lane->ro) ro_push(job->lane->ro, job->piece, recs, n);
+    else                    q_push(job->lane->q, recs, n);
+}
+
+/*
+ * The name of the shard holding a tile, or of the file it is written to until it is complete
+ */
+static char *shardFileName(opts_t *opts, int tile, bool tmp)
+{
+    char *fname = malloc(strlen(opts->shard_dir) + 64);
+    if (!fname) { fprintf(stderr,"Can't allocate memory for file name\n"); exit(1); }
+    sprintf(fname, "%s/s_%d_%04d.bam%s", opts->shard_dir, opts->lane, tile, tmp ? ".tmp" : "");
+    return fname;
+}
+
+static void printInts(FILE *f, char *name, ia_t *ia)
+{
+    fprintf(f, "\t%s:", name);
+    for (int n=0; n < ia->end; n++) fprintf(f, "%s%d", n ? "," : "", ia->entries[n]);
+}
+
+static void printStrings(FILE *f, char *name, va_t *va)
+{
+    fprintf(f, "\t%s:", name);
+    for (int n=0; n < va->end; n++) fprintf(f, "%s%s", n ? "," : "", (char *)va->entries[n]);
+}
+
+/*
+ * Make the @CO line which records, in each shard's header, the options which change its records.
+ * A restarted conversion can only keep the shards whose options match its own, but the rest of
+ * its command line, such as the number of threads or the output file, can differ.
+ */
+static char *shardOptions(opts_t *opts)
+{
+    char *line = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&line, &len);
+    if (!f) { fprintf(stderr,"Can't allocate memory for shard options\n"); exit(1); }
+
+    char *id = getId(opts);
+    fprintf(f, "@CO\ti2b shard options\tid:%s\tread-group-id:%s\tno-filter:%d\tno-index-separator:%d",
+            id, opts->read_group_id, opts->no_filter, !opts->separator);
+    free(id);
+    printInts(f, "first-cycle", opts->first_cycle);
+    printInts(f, "final-cycle", opts->final_cycle);
+    printInts(f, "first-index-cycle", opts->first_index_cycle);
+    printInts(f, "final-index-cycle", opts->final_index_cycle);
+    printInts(f, "bc-read", opts->bc_read);
+    printStrings(f, "barcode-tag", opts->barcode_tag);
+    printStrings(f, "quality-tag", opts->quality_tag);
+    fprintf(f, "\n");
+
+    if (fclose(f) != 0) { fprintf(stderr,"Can't allocate memory for shard options\n"); exit(1); }
+    return line;
+}
+
+/*
+ * Does the header have this line, including its newline?
+ */
+static bool headerHasLine(bam_hdr_t *hdr, char *line)
+{
+    size_t len = strlen(line);
+    char *end = hdr->text + hdr->l_text;
+
+    for (char *p = hdr->text; p && p + len <= end; ) {
+        if (memcmp(p, line, len) == 0) return true;
+        p = memchr(p, '\n', end - p);
+        if (p) p++;
+    }
+    return false;
+}
+
+/*
+ * Start writing a tile to its own shard
+ */
+static void openShard(job_data_t *job_data, job_t *job, int tile)
+{
+    opts_t *opts = job->lane->opts;
+    char mode[] = "wbC";
+    char *fname = shardFileName(opts, tile, true);
+
+    makeParentDir(fname);
+    mode[2] = opts->compression_level ? opts->compression_level : '\0';
+    job->shard = hts_open(fname, mode);
+    if (!job->shard) {
+        fprintf(stderr, "Could not open shard (%s)\n", fname);
         exit(1);
     }
 
-    // add index tags
-    for (int n=0; n < ib->end; n++) {
-        update_aux(bam, opts->barcode_tag->entries[n], ib->entries[n], opts->separator ? INDEX_SEPARATOR : NULL);
-        update_aux(bam, opts->quality_tag->entries[n], iq->entries[n], opts->separator ? QUAL_SEPARATOR : NULL);
+    // each shard has its own copy of the header, as the lane's may not be safe to read in several threads
+    if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    job->shard_header = bam_hdr_dup(job->lane->output_header);
+    pthread_mutex_unlock(&job_data->mutex);
+    if (job->shard_header) {
+        size_t len = strlen(job->lane->shard_options);
+        char *text = realloc(job->shard_header->text, job->shard_header->l_text + len + 1);
+        if (!text) { fprintf(stderr,"Can't allocate memory for shard header\n"); exit(1); }
+        memcpy(text + job->shard_header->l_text, job->lane->shard_options, len + 1);
+        job->shard_header->text = text;
+        job->shard_header->l_text += len;
+    }
+    if (!job->shard_header || sam_hdr_write(job->shard, job->shard_header) != 0) {
+        fprintf(stderr, "Failed to write header to %s\n", fname);
+        exit(1);
     }
+    free(fname);
+}
+
+/*
+ * Finish a tile's shard, and rename it into place to show that it is complete
+ */
+static void closeShard(job_t *job, int tile)
+{
+    char *tmpname = shardFileName(job->lane->opts, tile, true);
+    char *fname = shardFileName(job->lane->opts, tile, false);
 
-    return bam;
+    if (sam_close(job->shard) < 0 || rename(tmpname, fname) != 0) {
+        fprintf(stderr, "Failed to write shard %s\n", fname);
+        exit(1);
+    }
+    bam_hdr_destroy(job->shard_header);
+    job->shard = NULL;
+    job->shard_header = NULL;
+    free(tmpname);
+    free(fname);
 }
 
 /*
- * Read records from the queue and write them to the BAM file.
- * Exit when the queue is empty AND there are no more input threads running.
+ * Join a lane's shards, in tile order, onto its output file, after the header.
+ * The compressed blocks are copied as they are, except for the end of the block holding the
+ * shard's header, and the empty block at the end of each shard.
+ * Returns 0 on success, or 1 on failure.
  */
-static void *output_thread(void *arg)
+static int catShards(lane_t *lane)
 {
-    int r = 1;
-    bam1_t *rec;
-    job_data_t *job_data = (job_data_t *)arg;
-    opts_t *opts = job_data->opts;
-    
-    if (opts->verbose) fprintf(stderr,"Started output thread\n");
+    static const uint8_t bgzf_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+    BGZF *out = lane->output_file->fp.bgzf;
+    uint8_t *buf = malloc(SHARD_COPY_BUFFER + sizeof(bgzf_eof));
+    int retcode = 0;
 
-    while (job_data->q->count || *(job_data->tiles_left)) {
-        rec = q_pop(job_data->q);
-        if (rec) r = sam_write1(job_data->output_file, job_data->output_header, rec);
-        if (r <= 0) {
-            fprintf(stderr, "Problem writing record %s  : r=%d\n", bam_get_qname(rec),r);
-            exit(1);
+    if (!buf) { fprintf(stderr,"Can't allocate memory for shard buffer\n"); exit(1); }
+    if (bgzf_flush(out) < 0) {
+        fprintf(stderr, "Failed to write %s\n", lane->opts->output_file);
+        retcode = 1;
+    }
+
+    for (int t=0; t < lane->tiles->end && !retcode; t++) {
+        char *fname = shardFileName(lane->opts, lane->tiles->entries[t], false);
+        if (access(fname, F_OK) != 0) {
+            // the tile couldn't be read, which has already been reported
+            free(fname);
+            continue;
+        }
+
+        BGZF *in = bgzf_open(fname, "r");
+        bam_hdr_t *hdr = in ? bam_hdr_read(in) : NULL;
+        if (!hdr) {
+            fprintf(stderr, "Can't read shard %s\n", fname);
+            retcode = 1;
+        } else if (!headerHasLine(hdr, lane->shard_options)) {
+            fprintf(stderr, "Shard %s was written with different options. Remove it, or use the same options\n", fname);
+            retcode = 1;
+        }
+        bam_hdr_destroy(hdr);
+
+        // any records in the rest of the block are compressed again
+        if (!retcode && in->block_offset < in->block_length) {
+            if (bgzf_write(out, (uint8_t *)in->uncompressed_block + in->block_offset, in->block_length - in->block_offset) < 0 ||
+                bgzf_flush(out) < 0) {
+                fprintf(stderr, "Failed to write %s\n", lane->opts->output_file);
+                retcode = 1;
+            }
+        }
+
+        // hold back the last bytes read, until we know whether they are the end of the shard
+        ssize_t len = 0;
+        int held = 0;
+        while (!retcode && (len = bgzf_raw_read(in, buf + held, SHARD_COPY_BUFFER)) > 0) {
+            len += held;
+            held = len < sizeof(bgzf_eof) ? len : sizeof(bgzf_eof);
+            if (len > held && bgzf_raw_write(out, buf, len - held) < 0) {
+                fprintf(stderr, "Failed to write %s\n", lane->opts->output_file);
+                retcode = 1;
+            }
+            memmove(buf, buf + len - held, held);
         }
-        if (rec) bam_destroy1(rec);
+        if (!retcode && (len < 0 || held != sizeof(bgzf_eof) || memcmp(buf, bgzf_eof, held) != 0)) {
+            fprintf(stderr, "Shard %s is damaged\n", fname);
+            retcode = 1;
+        }
+
+        if (in) bgzf_close(in);
+        free(fname);
     }
-    return NULL;
+
+    free(buf);
+    return retcode;
 }
 
 /*
- * Write all the BAM records for a given tile
- * Records are written to the global FIFO queue
+ * Move a job which starts part way through a tile to its first cluster.
+ * The filter and position files are read up to that point, and the bcl files seeked.
  */
-static void *processTile(void *arg)
+static void skipClusters(tileIndex_t *tileIndex, int tile, tileBuffer_t *tb, filter_t *filter, posfile_t *posfile, va_t *bclReadArray, int start)
 {
-    job_data_t *job_data = (job_data_t *)arg;
-    int tile = job_data->tile;
-    samFile *output_file = job_data->output_file;
-    bam_hdr_t *output_header = job_data->output_header;
+    int base = tileIndex ? findClusterNumber(tile, tileIndex) : 0;
+
+    while (filter->current_cluster < start) {
+        int n = start - filter->current_cluster;
+        if (n > tb->size) n = tb->size;
+        if (filter_load_tile(filter, tb->pf, n) <= 0) break;
+    }
+    for (int skipped = 0; skipped < start; ) {
+        int n = start - skipped;
+        if (n > tb->size) n = tb->size;
+        if ((n = posfile_load_tile(posfile, tb->x, tb->y, n)) <= 0) break;
+        skipped += n;
+    }
+    for (int n=0; n < bclReadArray->end; n++) {
+        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+        for (int i=0; i < ra->bclFileArray->end; i++) {
+            bclfile_t *bcl = ra->bclFileArray->entries[i];
+            // CBCL files with the pfFlag set only contain the clusters which passed the filter
+            if (bcl->file_type == BCL_CBCL) bclfile_seek_cluster(bcl, bcl->pfFlag ? filter->current_pf_cluster : start);
+            else                            bclfile_seek(bcl, base + start);
+        }
+    }
+}
+
+/*
+ * Add up the bytes read from a tile's BCL files, and the time spent inflating them
+ */
+static void bclStats(va_t *bclReadArray, tileStats_t *ts)
+{
+    for (int n=0; n < bclReadArray->end; n++) {
+        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+        for (int i=0; i < ra->bclFileArray->end; i++) {
+            bclfile_t *bcl = ra->bclFileArray->entries[i];
+            int type = bcl->file_type == BCL_CBCL ? STATS_CBCL : bcl->file_type == BCL_SCL ? STATS_SCL : STATS_BCL;
+            ts->bytes[type] += bcl->bytes_read;
+            ts->inflate += bcl->inflate_time;
+        }
+    }
+}
+
+/*
+ * Add a job's statistics to its tile's, and count its records towards the progress
+ */
+static void addJobStats(job_data_t *job_data, job_t *job, tileStats_t *ts)
+{
+    if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    job_data->records += ts->records;
+    if (job->lane->stats) {
+        tileStats_t *sum = &job->lane->stats[job->tile_index];
+        sum->njobs++;
+        sum->seconds += ts->seconds;
+        sum->open += ts->open;
+        sum->read += ts->read;
+        sum->inflate += ts->inflate;
+        sum->build += ts->build;
+        sum->wait += ts->wait;
+        sum->write += ts->write;
+        sum->records += ts->records;
+        for (int n=0; n < STATS_NFILES; n++) sum->bytes[n] += ts->bytes[n];
+    }
+    pthread_mutex_unlock(&job_data->mutex);
+}
+
+/*
+ * Write all the BAM records for a job (a range of clusters in a tile)
+ * Records are written to the global FIFO queue, or to the job's piece of the reorder buffer
+ */
+static void processJob(job_data_t *job_data, job_t *job)
+{
+    lane_t *lane = job->lane;
+    int tile = lane->tiles->entries[job->tile_index];
     va_t *cycleRange = job_data->cycleRange;
-    va_t *tileIndex = job_data->tileIndex;
-    opts_t *opts = job_data->opts;
+    tileIndex_t *tileIndex = lane->tileIndex;
+    opts_t *opts = lane->opts;
 
     va_t *bclReadArray;
     int filtered;
-    int max_cluster = 0;
+    int max_cluster;
     int nRecords = 0;
     bool novaSeq;
     int surface = bcl_tile2surface(tile);
+    tileStats_t ts = { 0 };
+    struct timespec job_start, t, *timer = opts->stats_json ? &t : NULL;
+
+    if (opts->shard_dir) {
+        char *fname = shardFileName(opts, tile, false);
+        bool done = access(fname, F_OK) == 0;
+        free(fname);
+        if (done) {
+            if (opts->verbose) fprintf(stderr,"Tile %d has already been written\n", tile);
+            return;
+        }
+    }
 
-    if (opts->verbose) fprintf(stderr,"Processing Tile %d\n", tile);
+    if (opts->verbose) {
+        if (job->start) fprintf(stderr,"Processing Tile %d from cluster %d\n", tile, job->start);
+        else            fprintf(stderr,"Processing Tile %d\n", tile);
+    }
+    if (timer) {
+        clock_gettime(CLOCK_MONOTONIC, timer);
+        job_start = *timer;
+    }
     posfile_t *posfile = openPositionFile(tile, tileIndex, opts);
     if (posfile->errmsg) {
         fprintf(stderr,"Can't find position file for Tile %d\n%s\n", tile, posfile->errmsg);
-        return NULL;
+        if (job->start) exit(1);
+        posfile_close(posfile);
+        return;
     }
 
     filter_t *filter = openFilterFile(tile,tileIndex,opts);
     if (filter->errmsg) {
         fprintf(stderr,"Can't find filter file for tile %d\n%s\n", tile, filter->errmsg);
-        return NULL;
+        if (job->start) exit(1);
+        filter_close(filter);
+        posfile_close(posfile);
+        return;
     }
 
-    if (tileIndex) max_cluster = findClusters(tile, tileIndex);
+    // now that we know how big the tile is, other workers can take part of it
+    max_cluster = tileIndex ? findClusters(tile, tileIndex) : filter->total_clusters;
+    if (job->start == 0) {
+        if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+        job->end = max_cluster;
+        pthread_cond_broadcast(&job_data->job_changed);
+        pthread_mutex_unlock(&job_data->mutex);
+        if (lane->ro) ro_set_tile_end(lane->ro, job->tile_index, max_cluster);
+    }
 
-    bclReadArray = openBclFiles(cycleRange, opts, tile, tileIndex, &novaSeq, filter);
+    bclReadArray = openBclFiles(cycleRange, opts, tile, tileIndex, &novaSeq, filter, job_data->inflate_pool);
     char *id = getId(opts);
+    char readName[READ_NAME_BUFFER];
+    int prefix_len = readNamePrefix(readName, id, opts->lane, tile);
+    if (opts->shard_dir) openShard(job_data, job, tile);
 
     bool ispaired = readArrayContains(bclReadArray, "read2");
 
+    tileBuffer_t *tb = newTileBuffer(bclReadArray, opts->tile_buffer);
+    tileSegment_t *read1 = findTileSegment(tb, "read1");
+    tileSegment_t *read2 = findTileSegment(tb, "read2");
+
+    if (job->start) skipClusters(opts->live_store ? NULL : tileIndex, tile, tb, filter, posfile, bclReadArray, job->start);
+    size_t filter_start = job->start ? filter->pos : 0;
+    size_t posfile_start = job->start ? posfile->pos : 0;
+
+    // find each index read, and whether it goes in the first or second read
+    va_t *indexes1 = va_init(5,NULL);
+    va_t *indexes2 = va_init(5,NULL);
+    for (int c=0; c < cycleRange->end; c++) {
+        char *cname = getCycleName(c+1,true);
+        tileSegment_t *seg = findTileSegment(tb, cname);
+        if (seg) {
+            if (c >= opts->bc_read->end) ia_push(opts->bc_read,1);   // supply a default
+            if (opts->bc_read->entries[c] == 2) va_push(indexes2, seg);
+            else                                va_push(indexes1, seg);
+        }
+        free(cname);
+    }
+
     //
-    // write all the records
+    // write all the records, a batch at a time
     //
-    while ( (filtered = filter_next(filter)) >= 0) {
-        if (tileIndex && filter->current_cluster > max_cluster) break;
-        filtered = !filtered;   // actual flag is 'passed', but we want 'filtered out'
-        posfile_next(posfile);
-
-        char *readName = getReadName(id, opts->lane, tile, posfile->x, posfile->y);
-        va_t *bases, *qualities, *bases_index, *qualities_index, *bases_index2, *qualities_index2;
-        bases = va_init(2,free); qualities = va_init(2,free);
-        bases_index = va_init(5,free); qualities_index = va_init(5,free); bases_index2 = va_init(5,free); qualities_index2 = va_init(5,free);
-
-        getBases(bclReadArray, "read1", bases, qualities, false, filtered, surface);
-        if (ispaired) getBases(bclReadArray, "read2", bases, qualities, false, filtered, surface);
-
-        // read each index and put into first or second read
-        for (int c=0; c < cycleRange->end; c++) {
-            char *cname = getCycleName(c+1,true);
-            if (readArrayContains(bclReadArray,cname)) {
-                if (c >= opts->bc_read->end) ia_push(opts->bc_read,1);   // supply a default
-                if (opts->bc_read->entries[c] == 2) getBases(bclReadArray, cname, bases_index2, qualities_index2, true, filtered, surface);
-                else                                getBases(bclReadArray, cname, bases_index, qualities_index, true, filtered, surface);
-            }
-            free(cname);
-        }
-
-        if (opts->no_filter || !filtered) {
-            int flags;
-            bam1_t *rec1 = NULL;
-            bam1_t *rec2 = NULL;
-            flags = setFlag(false,filtered,ispaired);
-            rec1 = makeRecord(flags, opts, readName, bases->entries[0], qualities->entries[0], bases_index, qualities_index, output_file, output_header);
-            if (ispaired) {
-                flags = setFlag(true,filtered,ispaired);
-                rec2 = makeRecord(flags, opts, readName, bases->entries[1], qualities->entries[1], bases_index2, qualities_index2, output_file, output_header);
-            }
-            nRecords++;
-            while ( q_push(job_data->q, rec1, rec2) ) {
-                //if (opts->verbose) fprintf(stderr,"WARNING: Queue full [%d]\n", tile);
-                sleep(1);
+    bam1_t *batch[Q_BATCH];
+    int nbatch = 0;
+    bam1_t *spare[Q_BATCH];     // records taken from the pool
+    int nspare = 0;
+    int batch_size = (lane->q && lane->q->qlen < Q_BATCH) ? lane->q->qlen : Q_BATCH;
+    double *push_time = job->shard ? &ts.write : &ts.wait;
+    lap(timer, &ts.open);
+    for (;;) {
+        // the end of the job may have been moved by another worker taking the rest of it
+        if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+        job->pos = filter->current_cluster;
+        max_cluster = job->end;
+        pthread_mutex_unlock(&job_data->mutex);
+        int loaded = loadTileBuffer(tb, filter, posfile, max_cluster, surface, !opts->no_filter);
+        lap(timer, &ts.read);
+        if (loaded <= 0) break;
+
+        for (int c=0; c < tb->nclusters; c++) {
+            filtered = !tilePassed(tb, c);
+            if (opts->no_filter || !filtered) {
+                int flags;
+                bam1_t *rec1 = NULL;
+                bam1_t *rec2 = NULL;
+                int name_len = getReadName(readName, prefix_len, tb->x[c], tb->y[c]);
+                flags = setFlag(false,filtered,ispaired);
+                rec1 = getRecord(job_data->pool, spare, &nspare);
+                makeRecord(rec1, flags, opts, readName, name_len, tb, c, read1, indexes1);
+                if (ispaired) {
+                    flags = setFlag(true,filtered,ispaired);
+                    rec2 = getRecord(job_data->pool, spare, &nspare);
+                    makeRecord(rec2, flags, opts, readName, name_len, tb, c, read2, indexes2);
+                }
+                nRecords++;
+                if (nbatch + 2 > batch_size) {
+                    lap(timer, &ts.build);
+                    pushRecords(job, batch, nbatch);
+                    lap(timer, push_time);
+                    nbatch = 0;
+                }
+                batch[nbatch++] = rec1;
+                if (rec2) batch[nbatch++] = rec2;
             }
         }
+    }
+    lap(timer, &ts.build);
+    pushRecords(job, batch, nbatch);
+    rp_put(job_data->pool, spare, nspare);
+    if (job->shard) closeShard(job, tile);
+    lap(timer, push_time);
 
-        va_free(bases); va_free(qualities);
-        va_free(bases_index); va_free(qualities_index);
-        va_free(bases_index2); va_free(qualities_index2);
-        free(readName);
-
+    ts.records = ispaired ? 2L * nRecords : nRecords;
+    if (timer) {
+        ts.seconds = elapsed(&job_start);
+        ts.bytes[STATS_FILTER] = filter->pos - filter_start;
+        ts.bytes[STATS_POS] = posfile->pos - posfile_start;
+        bclStats(bclReadArray, &ts);
     }
+    addJobStats(job_data, job, &ts);
 
+    va_free(indexes1);
+    va_free(indexes2);
+    freeTileBuffer(tb);
     free(id);
     va_free(bclReadArray);
     filter_close(filter);
     posfile_close(posfile);
 
     if (opts->verbose) fprintf(stderr,"%d records written\n", nRecords);
+}
 
-    if (pthread_mutex_lock(job_data->n_threads_mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
-    (*job_data->n_threads)--;
-    (*job_data->tiles_left)--;
-    pthread_mutex_unlock(job_data->n_threads_mutex);
+static job_t *newJob(lane_t *lane, int tile_index, int start, int end)
+{
+    job_t *job = calloc(1, sizeof(job_t));
+    if (!job) { fprintf(stderr,"Can't allocate memory for job\n"); exit(1); }
+    job->lane = lane;
+    job->tile_index = tile_index;
+    job->start = job->pos = start;
+    job->end = end;
+    if (lane->ro) job->piece = ro_add(lane->ro, tile_index, start);
+    return job;
+}
+
+/*
+ * Start a job for a whole tile, from its position in the work list
+ */
+static job_t *newTileJob(job_data_t *job_data, int w)
+{
+    job_data->tiles_started++;
+    lane_t *lane = job_data->lanes->entries[job_data->work_lane->entries[w]];
+    return newJob(lane, job_data->work_tile->entries[w], 0, -1);
+}
+
+/*
+ * Find the next job for a worker. Must be called with the job_data mutex held.
+ * In order of preference, this is:
+ *   the next of the worker's own tiles
+ *   a tile not yet started by another worker
+ *   the second half of the largest range being worked on by another worker
+ * Returns NULL if there is nothing left to do.
+ */
+static job_t *getJob(worker_t *worker)
+{
+    job_data_t *job_data = worker->job_data;
+    worker_t *victim = NULL;
+    int best = 0;
+
+    if (worker->next_tile < worker->tiles->end) {
+        return newTileJob(job_data, worker->tiles->entries[worker->next_tile++]);
+    }
+
+    for (int n=0; n < job_data->nworkers; n++) {
+        worker_t *w = &job_data->workers[n];
+        if (w->tiles->end - w->next_tile > best) {
+            best = w->tiles->end - w->next_tile;
+            victim = w;
+        }
+    }
+    if (victim) {
+        worker->ntiles_stolen++;
+        return newTileJob(job_data, victim->tiles->entries[--victim->tiles->end]);
+    }
+
+    // a shard holds a whole tile, so tiles can't be shared
+    if (job_data->opts->shard_dir) return NULL;
+
+    // the split must be after the batch the other worker is reading now
+    int mid = 0;
+    for (int n=0; n < job_data->nworkers; n++) {
+        job_t *job = job_data->workers[n].job;
+        if (!job || job->end < 0) continue;
+        int m = (job->pos + job->end) / 2;
+        if (m < job->pos + job_data->opts->tile_buffer) m = job->pos + job_data->opts->tile_buffer;
+        if (job->end - m >= job_data->opts->min_split && job->end - m > best) {
+            best = job->end - m;
+            victim = &job_data->workers[n];
+            mid = m;
+        }
+    }
+    if (victim) {
+        job_t *job = newJob(victim->job->lane, victim->job->tile_index, mid, victim->job->end);
+        victim->job->end = mid;
+        worker->nsplits++;
+        return job;
+    }
 
     return NULL;
 }
 
 /*
- * process all the tiles and write all the BAM records
+ * Is another worker opening a tile, so that we don't know yet whether there is any of it to take?
+ * Must be called with the job_data mutex held.
  */
-static int createBAM(samFile *output_file, bam_hdr_t *output_header, opts_t *opts)
+static bool tileOpening(job_data_t *job_data)
 {
-    static int n_threads = 0;
-    static pthread_mutex_t n_threads_mutex;
+    if (job_data->opts->shard_dir) return false;
+    for (int n=0; n < job_data->nworkers; n++) {
+        job_t *job = job_data->workers[n].job;
+        if (job && job->end < 0) return true;
+    }
+    return false;
+}
 
-    static int tiles_left = 0;
-    static pthread_mutex_t tiles_left_mutex;
+/*
+ * Worker thread. Process jobs until there are none left, then tell the output thread it has finished
+ */
+static void *worker_thread(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    job_data_t *job_data = worker->job_data;
+    job_t *job;
 
-    bool output_thread_created = false;
-    int retcode = 0;
-    pthread_t tid, output_tid;
+    for (;;) {
+        struct timespec start;
+
+        if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+        while (!(job = getJob(worker)) && tileOpening(job_data)) {
+            pthread_cond_wait(&job_data->job_changed, &job_data->mutex);
+        }
+        worker->job = job;
+        pthread_mutex_unlock(&job_data->mutex);
+        if (!job) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        processJob(job_data, job);
+        worker->busy += elapsed(&start);
+        worker->njobs++;
+
+        // once the job is finished, nobody else can change its end
+        if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+        worker->job = NULL;
+        pthread_cond_broadcast(&job_data->job_changed);
+        pthread_mutex_unlock(&job_data->mutex);
+        if (job->end < 0) {
+            // the tile couldn't be read
+            job->end = job->start;
+            if (job->lane->ro) ro_set_tile_end(job->lane->ro, job->tile_index, job->end);
+        }
+        if (job->lane->ro) ro_done(job->lane->ro, job->piece, job->end);
+        free(job);
+    }
+
+    for (int n=0; n < job_data->lanes->end; n++) {
+        lane_t *lane = job_data->lanes->entries[n];
+        if (lane->q && !lane->ro) q_producer_done(lane->q);
+    }
 
-    job_data_t *o_job_data = malloc(sizeof(job_data_t));
-    if (!o_job_data) { fprintf(stderr,"Can't allocate memory for output_thread job_data\n"); exit(1); }
+    if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    job_data->nfinished++;
+    pthread_cond_signal(&job_data->finished);
+    pthread_mutex_unlock(&job_data->mutex);
+    return NULL;
+}
+
+/*
+ * Make the output file name for a lane, replacing each %d with the lane number
+ */
+static char *laneFileName(char *fname, int lane)
+{
+    char *out = malloc(strlen(fname) * 2 + 1);     // a lane number is at most three digits
+    char *p = out;
+    if (!out) { fprintf(stderr,"Can't allocate memory for file name\n"); exit(1); }
+    while (*fname) {
+        if (fname[0] == '%' && fname[1] == 'd') {
+            p += sprintf(p, "%d", lane);
+            fname += 2;
+        } else {
+            *p++ = *fname++;
+        }
+    }
+    *p = 0;
+    return out;
+}
+
+/*
+ * Create a lane, with a copy of the options for that lane.
+ * The copy shares everything except the lane number, output file name and platform unit.
+ */
+static lane_t *newLane(opts_t *opts, int lane_number)
+{
+    lane_t *lane = calloc(1, sizeof(lane_t));
+    opts_t *lo = malloc(sizeof(opts_t));
+    if (!lane || !lo) { fprintf(stderr,"Can't allocate memory for lane\n"); exit(1); }
+    *lo = *opts;
+    lo->lane = lane_number;
+    lo->output_file = laneFileName(opts->output_file, lane_number);
+    if (opts->platform_unit) {
+        lo->platform_unit = strdup(opts->platform_unit);
+    } else {
+        // default is runfolder + lane
+        char *rf = basename(opts->run_folder);
+        lo->platform_unit = calloc(1, strlen(rf) + 5);
+        sprintf(lo->platform_unit, "%s_%d", rf, lane_number);
+    }
+    lane->opts = lo;
+    return lane;
+}
+
+static void freeLane(void *ent)
+{
+    lane_t *lane = (lane_t *)ent;
+    if (lane->output_header) bam_hdr_destroy(lane->output_header);
+    if (lane->output_file) sam_close(lane->output_file);
+    if (lane->tiles) ia_free(lane->tiles);
+    freeTileIndex(lane->tileIndex);
+    q_destroy(lane->q);
+    ro_destroy(lane->ro);
+    free(lane->stats);
+    free(lane->shard_options);
+    free(lane->opts->output_file);
+    free(lane->opts->platform_unit);
+    free(lane->opts);
+    free(lane);
+}
+
+/*
+ * Write a string as a JSON string
+ */
+static void jsonString(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/*
+ * Write the statistics for the whole run to the --stats-json file
+ */
+static int writeStats(job_data_t *job_data, double worker_wall, double wall)
+{
+    opts_t *opts = job_data->opts;
+    FILE *f = fopen(opts->stats_json, "w");
+    if (!f) {
+        fprintf(stderr,"Can't open %s: %s\n", opts->stats_json, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"run_folder\": ");
+    jsonString(f, opts->run_folder);
+    fprintf(f, ",\n  \"max_threads\": %d,\n  \"compression_threads\": %d,\n  \"queue_len\": %d,\n",
+            opts->max_threads, opts->compression_threads, opts->qlen);
+    fprintf(f, "  \"tile_order\": %s,\n  \"reorder_window\": %d,\n  \"shards\": %s,\n",
+            opts->tile_order ? "true" : "false", opts->reorder_window, opts->shard_dir ? "true" : "false");
+    fprintf(f, "  \"records\": %ld,\n  \"worker_seconds\": %.3f,\n  \"wall_seconds\": %.3f,\n",
+            job_data->records, worker_wall, wall);
+
+    fprintf(f, "  \"workers\": [");
+    for (int n=0; n < job_data->nworkers; n++) {
+        worker_t *w = &job_data->workers[n];
+        fprintf(f, "%s\n    { \"id\": %d, \"jobs\": %d, \"tiles_stolen\": %d, \"splits\": %d, \"busy_seconds\": %.3f }",
+                n ? "," : "", w->id, w->njobs, w->ntiles_stolen, w->nsplits, w->busy);
+    }
+    fprintf(f, "\n  ],\n  \"lanes\": [");
+
+    for (int n=0; n < job_data->lanes->end; n++) {
+        lane_t *lane = job_data->lanes->entries[n];
+        fprintf(f, "%s\n    {\n      \"lane\": %d,\n      \"output_file\": ", n ? "," : "", lane->opts->lane);
+        jsonString(f, lane->opts->output_file);
+        fprintf(f, ",\n      \"output_wait_seconds\": %.3f,\n      \"output_write_seconds\": %.3f,\n      \"tiles\": [",
+                lane->output_wait, lane->output_write);
+        for (int t=0; t < lane->tiles->end; t++) {
+            tileStats_t *ts = &lane->stats[t];
+            fprintf(f, "%s\n        { \"tile\": %d, \"jobs\": %d, \"records\": %ld, \"seconds\": %.3f, "
+                       "\"open_seconds\": %.3f, \"read_seconds\": %.3f, \"inflate_seconds\": %.3f, "
+                       "\"build_seconds\": %.3f, \"wait_seconds\": %.3f, \"write_seconds\": %.3f, \"bytes\": {",
+                    t ? "," : "", lane->tiles->entries[t], ts->njobs, ts->records, ts->seconds,
+                    ts->open, ts->read, ts->inflate, ts->build, ts->wait, ts->write);
+            for (int b=0; b < STATS_NFILES; b++) {
+                fprintf(f, "%s\"%s\": %llu", b ? ", " : " ", statsFileType[b], (unsigned long long)ts->bytes[b]);
+            }
+            fprintf(f, " } }");
+        }
+        fprintf(f, "\n      ]\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    if (fclose(f)) {
+        fprintf(stderr,"Can't write %s: %s\n", opts->stats_json, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for the workers to finish, showing how far they have got every interval seconds
+ */
+static void showProgress(job_data_t *job_data, int ntiles, struct timespec *start, int interval)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    if (pthread_mutex_lock(&job_data->mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
+    while (job_data->nfinished < job_data->nworkers) {
+        deadline.tv_sec += interval;
+        while (job_data->nfinished < job_data->nworkers &&
+               pthread_cond_timedwait(&job_data->finished, &job_data->mutex, &deadline) != ETIMEDOUT)
+            ;
+        if (job_data->nfinished < job_data->nworkers) {
+            double secs = elapsed(start);
+            fprintf(stderr,"Progress: %d of %d tiles started, %ld records written in %.0fs (%.0f records/s)\n",
+                    job_data->tiles_started, ntiles, job_data->records, secs, secs > 0 ? job_data->records / secs : 0);
+        }
+    }
+    pthread_mutex_unlock(&job_data->mutex);
+}
+
+/*
+ * process all the tiles of all the lanes and write all the BAM records
+ */
+static int createBAM(va_t *lanes, opts_t *opts)
+{
+    int retcode = 0;
+    struct timespec start;
+    int ntiles = 0;
+    int maxtiles = 0;
+    int qsize = 0;
 
-    pthread_mutex_init(&n_threads_mutex,NULL);
-    queue_t *q = malloc(sizeof(queue_t));
-    if (!q) { fprintf(stderr,"Can't allocate memory for results queue\n"); exit(1); }
+    job_data_t *job_data = calloc(1, sizeof(job_data_t));
+    if (!job_data) { fprintf(stderr,"Can't allocate memory for job_data\n"); exit(1); }
 
-    ia_t *tiles = getTileList(opts);
     va_t *cycleRange = getCycleRange(opts);;
-    va_t *tileIndex = getTileIndex(opts);
 
-    q_init(q, opts->qlen);
+    // threads to inflate CBCL blocks are only worth having if this htslib has thread pools
+    job_data->inflate_pool = bclfile_pool_init(opts->inflate_threads);
+    int inflate_threads = job_data->inflate_pool ? opts->inflate_threads : 0;
+    if (opts->inflate_threads && !job_data->inflate_pool) {
+        fprintf(stderr,"WARNING: can't create a thread pool, so the workers will inflate their own CBCL blocks\n");
+    }
+
+    // the main thread and an output thread for each lane, and the compression and inflate threads, share the rest
+    int nworkers = opts->max_threads - 1 - (opts->shard_dir ? 0 : lanes->end) - opts->compression_threads - inflate_threads;
+    // with no workers, nothing would be converted
+    if (nworkers < 1) nworkers = 1;
+
+    for (int n=0; n < lanes->end; n++) {
+        lane_t *lane = lanes->entries[n];
+        lane->tiles = getTileList(lane->opts);
+        lane->tileIndex = getTileIndex(lane->opts);
+        ntiles += lane->tiles->end;
+        if (lane->tiles->end > maxtiles) maxtiles = lane->tiles->end;
+        if (opts->stats_json) {
+            lane->stats = calloc(lane->tiles->end + 1, sizeof(tileStats_t));
+            if (!lane->stats) { fprintf(stderr,"Can't allocate memory for statistics\n"); exit(1); }
+        }
+        // with shards, the workers write the records themselves
+        if (opts->shard_dir) continue;
+
+        // every worker is a producer, and the output thread stops when they have all finished
+        lane->q = malloc(sizeof(queue_t));
+        if (!lane->q) { fprintf(stderr,"Can't allocate memory for results queue\n"); exit(1); }
+        q_init(lane->q, opts->qlen, nworkers);
+        lane->ro = opts->tile_order ? ro_init(lane->tiles->end, opts->reorder_window) : NULL;
+
+        qsize += lane->ro ? lane->ro->window : lane->q->qlen;
+    }
+
+    // enough free records for all those which can be queued, plus each thread's batches
+    recPool_t *pool = rp_init(qsize + (2 * nworkers + lanes->end) * Q_BATCH);
 
     if (opts->verbose) {
         for (int n=0; n < cycleRange->end; n++) {
             cycleRangeEntry_t *cr = (cycleRangeEntry_t *)cycleRange->entries[n];
             fprintf(stderr,"CycleRange: %s\t%d\t%d\n", cr->readname, cr->first, cr->last);
         }
-        for (int n=0; n < tiles->end; n++) {
-            fprintf(stderr,"Tile %d\n", tiles->entries[n]);
+        for (int n=0; n < lanes->end; n++) {
+            lane_t *lane = lanes->entries[n];
+            for (int t=0; t < lane->tiles->end; t++) {
+                if (lanes->end > 1) fprintf(stderr,"Lane %d ", lane->opts->lane);
+                fprintf(stderr,"Tile %d\n", lane->tiles->entries[t]);
+            }
+        }
+    }
+
+    if (ntiles == 0) fprintf(stderr, "There are no tiles to process\n");
+
+    // the work list takes the lanes in turn, so that they all progress together
+    job_data->work_lane = ia_init(ntiles + 1);
+    job_data->work_tile = ia_init(ntiles + 1);
+    for (int t=0; t < maxtiles; t++) {
+        for (int n=0; n < lanes->end; n++) {
+            lane_t *lane = lanes->entries[n];
+            if (t < lane->tiles->end) {
+                ia_push(job_data->work_lane, n);
+                ia_push(job_data->work_tile, t);
+            }
         }
     }
 
-    if (tiles->end == 0) fprintf(stderr, "There are no tiles to process\n");
-    tiles_left = tiles->end;
+    job_data->opts = opts;
+    job_data->cycleRange = cycleRange;
+    job_data->lanes = lanes;
+    job_data->pool = pool;
+    pthread_mutex_init(&job_data->mutex, NULL);
+    pthread_cond_init(&job_data->finished, NULL);
+    pthread_cond_init(&job_data->job_changed, NULL);
+    bclfile_set_stats(opts->stats_json != NULL);
 
     /*
-     * Loop to create input threads - one for each tile
+     * Create an output thread for each lane
      */
-    for (int n=0; n < tiles->end; n++) {
-        job_data_t *job_data = malloc(sizeof(job_data_t));
-        if (!job_data) { fprintf(stderr,"Can't allocate memory for job_data\n"); exit(1); }
-        job_data->tile = tiles->entries[n];
-        job_data->output_file = output_file;
-        job_data->output_header = output_header;
-        job_data->opts = opts;
-        job_data->cycleRange = cycleRange;
-        job_data->tileIndex = tileIndex;
-        job_data->q = q;
-        job_data->n_threads = &n_threads;
-        job_data->n_threads_mutex = &n_threads_mutex;
-        job_data->tiles_left = &tiles_left;
-
-        // the -2 is to allow for the main thread and output thread
-        while (n_threads >= opts->max_threads-2) {
-            if (opts->verbose) fprintf(stderr,"Waiting for thread to become free\n");
-            sleep(1);
-        }
-
-        if ( (retcode = pthread_create(&tid, NULL, processTile, job_data))) {
-            fprintf(stderr,"ABORT: Can't create thread for tile %d: Error code %d\n", job_data->tile, retcode);
+    for (int n=0; n < lanes->end; n++) {
+        lane_t *lane = lanes->entries[n];
+        lane->pool = pool;
+        if (opts->shard_dir) continue;
+        if ( (retcode = pthread_create(&lane->output_tid, NULL, output_thread, lane)) ) {
+            fprintf(stderr,"ABORT: Can't create output thread: Error code %d\n", retcode);
             exit(1);
         }
+    }
 
-        if (pthread_mutex_lock(&n_threads_mutex)) { fprintf(stderr,"mutex_lock failed\n"); exit(1); }
-        n_threads++;
-        pthread_mutex_unlock(&n_threads_mutex);
-        pthread_detach(tid);
-
-        if (!output_thread_created) {
-            /*
-             * Create output thread
-             */
-            o_job_data->tile = 0;
-            o_job_data->output_file = output_file;
-            o_job_data->output_header = output_header;
-            o_job_data->opts = opts;
-            o_job_data->q = q;
-            o_job_data->n_threads = &n_threads;
-            o_job_data->tiles_left = &tiles_left;
-
-            if ( (retcode = pthread_create(&output_tid, NULL, output_thread, o_job_data)) ) {
-                fprintf(stderr,"ABORT: Can't create output thread: Error code %d\n", retcode);
-                exit(1);
-            }
-            output_thread_created = true;
+    /*
+     * Create the workers. The tiles are dealt out in turn, so that they finish roughly in order.
+     */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job_data->nworkers = nworkers;
+    job_data->workers = calloc(nworkers, sizeof(worker_t));
+    if (!job_data->workers) { fprintf(stderr,"Can't allocate memory for workers\n"); exit(1); }
+    for (int n=0; n < nworkers; n++) {
+        worker_t *worker = &job_data->workers[n];
+        worker->job_data = job_data;
+        worker->id = n;
+        worker->tiles = ia_init(ntiles / nworkers + 1);
+        for (int t=n; t < ntiles; t += nworkers) ia_push(worker->tiles, t);
+    }
+    for (int n=0; n < nworkers; n++) {
+        if ( (retcode = pthread_create(&job_data->workers[n].tid, NULL, worker_thread, &job_data->workers[n])) ) {
+            fprintf(stderr,"ABORT: Can't create worker thread: Error code %d\n", retcode);
+            exit(1);
         }
     }
 
     /*
-     * Wait here until output thread (and therefore all threads) have finished
+     * Wait here until the workers and the output threads have finished
      */
-    if ( (retcode = pthread_join(output_tid,NULL)) ) {
-        fprintf(stderr,"ABORT: Can't join output thread: Error code %d\n", retcode);
-        exit(1);
+    if (opts->progress_interval) showProgress(job_data, ntiles, &start, opts->progress_interval);
+    for (int n=0; n < nworkers; n++) {
+        if ( (retcode = pthread_join(job_data->workers[n].tid, NULL)) ) {
+            fprintf(stderr,"ABORT: Can't join worker thread: Error code %d\n", retcode);
+            exit(1);
+        }
+    }
+    double wall = elapsed(&start);
+    for (int n=0; n < lanes->end; n++) {
+        lane_t *lane = lanes->entries[n];
+        if (opts->shard_dir) {
+            if (catShards(lane) != 0) retcode = 1;
+        } else if ( (retcode = pthread_join(lane->output_tid, NULL)) ) {
+            fprintf(stderr,"ABORT: Can't join output thread: Error code %d\n", retcode);
+            exit(1);
+        }
     }
+    if (opts->stats_json && writeStats(job_data, wall, elapsed(&start)) != 0) retcode = 1;
 
-    free(o_job_data);
-    q_destroy(q);
+    for (int n=0; n < nworkers; n++) {
+        worker_t *worker = &job_data->workers[n];
+        if (opts->verbose) {
+            fprintf(stderr,"Worker %d: %d jobs (%d tiles stolen, %d ranges split off), busy %.2fs of %.2fs (%.0f%%)\n",
+                    worker->id, worker->njobs, worker->ntiles_stolen, worker->nsplits,
+                    worker->busy, wall, wall > 0 ? 100 * worker->busy / wall : 0);
+        }
+        ia_free(worker->tiles);
+    }
+
+    free(job_data->workers);
+    ia_free(job_data->work_lane);
+    ia_free(job_data->work_tile);
+    pthread_mutex_destroy(&job_data->mutex);
+    pthread_cond_destroy(&job_data->finished);
+    pthread_cond_destroy(&job_data->job_changed);
+    bclfile_pool_destroy(job_data->inflate_pool);
+    free(job_data);
+    rp_destroy(pool);
     va_free(cycleRange);
-    va_free(tileIndex);
-    ia_free(tiles);
     return retcode;
 }
 
@@ -1660,51 +3558,105 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, opts_t *opt
 static int i2b(opts_t* opts)
 {
     int retcode = 1;
-    samFile *output_file = NULL;
-    bam_hdr_t *output_header = NULL;
-    htsFormat *out_fmt = NULL;
     char mode[] = "wbC";
+    va_t *lanes = va_init(opts->lanes->end, freeLane);
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    htsThreadPool tpool = { NULL, 0 };
+#endif
 
     while (1) {
 
+        // all the output files are compressed on one pool of threads
+        if (opts->compression_threads > 0) {
+#ifdef HAVE_HTS_SET_THREAD_POOL
+            tpool.pool = hts_tpool_init(opts->compression_threads);
+            if (!tpool.pool) {
+                fprintf(stderr, "Failed to create compression thread pool\n");
+                break;
+            }
+#endif
+        }
+
+        for (int n=0; n < opts->lanes->end; n++) va_push(lanes, newLane(opts, opts->lanes->entries[n]));
+
+        // in live mode, the BAM is only written once every cycle is in the live store
+        if (opts->live_store && liveStore(lanes, opts) != 0) break;
+
         /*
-         * Open output file and header
+         * Open an output file and header for each lane
          */
-        if (opts->output_fmt) {
-            out_fmt = calloc(1,sizeof(htsFormat));
-            if (hts_parse_format(out_fmt, opts->output_fmt) < 0) {
-                fprintf(stderr,"Unknown output format: %s\n", opts->output_fmt);
+        int n;
+        for (n=0; n < lanes->end; n++) {
+            lane_t *lane = lanes->entries[n];
+            htsFormat *out_fmt = NULL;
+
+            if (opts->output_fmt) {
+                out_fmt = calloc(1,sizeof(htsFormat));
+                if (hts_parse_format(out_fmt, opts->output_fmt) < 0) {
+                    fprintf(stderr,"Unknown output format: %s\n", opts->output_fmt);
+                    free(out_fmt);
+                    break;
+                }
+            }
+            mode[2] = opts->compression_level ? opts->compression_level : '\0';
+            lane->output_file = hts_open_format(lane->opts->output_file, mode, out_fmt);
+            free(out_fmt);
+            if (!lane->output_file) {
+                fprintf(stderr, "Could not open output file (%s)\n", lane->opts->output_file);
                 break;
             }
-        }
-        mode[2] = opts->compression_level ? opts->compression_level : '\0';
-        output_file = hts_open_format(opts->output_file, mode, out_fmt);
-        free(out_fmt);
-        if (!output_file) {
-            fprintf(stderr, "Could not open output file (%s)\n", opts->output_file);
-            break;
-        }
 
-        output_header = bam_hdr_init();
-        output_header->text = calloc(1,1); output_header->l_text=0;
+            if (opts->compression_threads > 0) {
+#ifdef HAVE_HTS_SET_THREAD_POOL
+                if (hts_set_thread_pool(lane->output_file, &tpool) < 0) {
+                    fprintf(stderr, "Failed to create compression thread pool\n");
+                    break;
+                }
+#else
+                // share the threads between the files
+                int nthreads = opts->compression_threads / opts->lanes->end;
+                if (hts_set_threads(lane->output_file, nthreads > 0 ? nthreads : 1) < 0) {
+                    fprintf(stderr, "Failed to set compression threads\n");
+                    break;
+                }
+#endif
+            }
 
-        if (!output_header) {
-            fprintf(stderr, "Failed to initialise output header\n");
-            break;
-        }
+            lane->output_header = bam_hdr_init();
+            if (!lane->output_header) {
+                fprintf(stderr, "Failed to initialise output header\n");
+                break;
+            }
+            lane->output_header->text = calloc(1,1); lane->output_header->l_text=0;
+
+            if (addHeader(lane->output_file, lane->output_header, lane->opts) != 0) {
+                fprintf(stderr,"Failed to write header\n");
+                break;
+            }
 
-        if (addHeader(output_file, output_header, opts) != 0) {
-            fprintf(stderr,"Failed to write header\n");
-            break;
+            // shards are joined by copying their compressed blocks
+            if (opts->shard_dir && lane->output_file->format.format != bam) {
+                fprintf(stderr,"--shard-dir needs BAM output\n");
+                break;
+            }
+            if (opts->shard_dir) lane->shard_options = shardOptions(lane->opts);
         }
+        if (n < lanes->end) break;
 
-        retcode = createBAM(output_file, output_header, opts);
+        bclfile_set_mmap(opts->mmap);
+        retcode = createBAM(lanes, opts);
         break;
     }
 
     // tidy up after us
-    if (output_header) bam_hdr_destroy(output_header);
-    if (output_file) sam_close(output_file);
+    va_free(lanes);
+#ifdef HAVE_HTS_SET_THREAD_POOL
+    // the pool must outlive the files
+    if (tpool.pool) hts_tpool_destroy(tpool.pool);
+#endif
+    bclfile_free_header_cache();
+    posfile_free_shared_cache();
+    filter_free_shared_cache();
     
     return retcode;
 }
@@ -25,13 +25,60 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <libgen.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "posfile.h"
 
+/*
+ * Map the whole file into memory, or read it if it can't be mapped.
+ * Returns 0 on success, -1 on error
+ */
+static int posfile_load(posfile_t *posfile)
+{
+    struct stat st;
+
+    if (fstat(posfile->fhandle, &st) < 0) return -1;
+    posfile->data_size = st.st_size;
+    posfile->pos = 0;
+    if (posfile->data_size == 0) return 0;
+
+    posfile->data = mmap(NULL, posfile->data_size, PROT_READ, MAP_PRIVATE, posfile->fhandle, 0);
+    if (posfile->data != MAP_FAILED) {
+        posfile->mapped = true;
+        madvise(posfile->data, posfile->data_size, MADV_SEQUENTIAL);
+        return 0;
+    }
+
+    posfile->data = malloc(posfile->data_size);
+    if (!posfile->data) return -1;
+    for (size_t n = 0; n < posfile->data_size; ) {
+        ssize_t r = read(posfile->fhandle, posfile->data + n, posfile->data_size - n);
+        if (r <= 0) return -1;
+        n += r;
+    }
+    return 0;
+}
+
+/*
+ * Copy len bytes from the current position, and move past them.
+ * Returns 0 on success, or -1 if there aren't enough bytes left
+ */
+static inline int posfile_get(posfile_t *posfile, void *dst, size_t len)
+{
+    if (posfile->pos + len > posfile->data_size) return -1;
+    memcpy(dst, posfile->data + posfile->pos, len);
+    posfile->pos += len;
+    return 0;
+}
+
 posfile_t *posfile_open(char *fname)
 {
     posfile_t *posfile = calloc(1, sizeof(posfile_t));
@@ -61,12 +108,15 @@ posfile_t *posfile_open(char *fname)
         return posfile;
     }
 
+    if (posfile_load(posfile) < 0) {
+        fprintf(stderr,"failed to read %s\n", fname);
+        exit(1);
+    }
+
     if (posfile->file_type == CLOCS) {
-        int n;
-        n = read(posfile->fhandle,(void *)&posfile->version,1);
-        n = read(posfile->fhandle,(void *)&posfile->total_blocks,4);
-        n = read(posfile->fhandle,(void *)&posfile->unread_clusters,1);
-        if (n<0) {
+        if (posfile_get(posfile, &posfile->version, 1) < 0 ||
+            posfile_get(posfile, &posfile->total_blocks, 4) < 0 ||
+            posfile_get(posfile, &posfile->unread_clusters, 1) < 0) {
             fprintf(stderr,"failed to read header from %s\n", fname);
             exit(1);
         }
@@ -74,12 +124,9 @@ posfile_t *posfile_open(char *fname)
     }
 
     if (posfile->file_type == LOCS) {
-        int n;
         // first 8 bytes are unused
-        n = read(posfile->fhandle,(void *)&posfile->total_blocks,4);
-        n = read(posfile->fhandle,(void *)&posfile->total_blocks,4);
-        n = read(posfile->fhandle,(void *)&posfile->total_blocks,4);
-        if (n<0) {
+        posfile->pos = 8;
+        if (posfile_get(posfile, &posfile->total_blocks, 4) < 0) {
             fprintf(stderr,"failed to read header from %s\n", fname);
             exit(1);
         }
@@ -93,26 +140,98 @@ posfile_t *posfile_open(char *fname)
  */
 void posfile_seek(posfile_t *posfile, int cluster)
 {
-    off_t pos = 12 + cluster * 8;
+    size_t pos = 12 + (size_t)cluster * 8;
     if (posfile->file_type != LOCS) {
         fprintf(stderr,"Can only handle NextSeq pos files of type LOC\n");
         exit(1);
     }
 
-    off_t r = lseek(posfile->fhandle, pos, SEEK_SET);
-    if (r != pos) {
-        fprintf(stderr,"Trying to seek to %d (cluster %d) but returned %d\n", (int)pos, cluster, (int)r);
-        perror("posfile_seek() failed");
+    if (pos > posfile->data_size) {
+        fprintf(stderr,"Trying to seek to %lu (cluster %d) but file is only %lu bytes\n", (unsigned long)pos, cluster, (unsigned long)posfile->data_size);
+        pos = posfile->data_size;
     }
+    posfile->pos = pos;
 }
 
 void posfile_close(posfile_t *posfile)
 {
     free(posfile->errmsg);
+    if (posfile->mapped)       munmap(posfile->data, posfile->data_size);
+    else if (!posfile->shared) free(posfile->data);
     if (posfile->fhandle >= 0) close(posfile->fhandle);
     free(posfile);
 }
 
+/*
+ * Cache of lane level position files (s.locs, s_N.locs), which hold every tile.
+ * posfile_open_shared() returns a private reader over the cached data,
+ * which the caller can seek and close as usual.
+ */
+typedef struct posfile_cache_s {
+    char *fname;
+    posfile_t *posfile;
+    struct posfile_cache_s *next;
+} posfile_cache_t;
+
+static posfile_cache_t *posfile_cache = NULL;
+static pthread_mutex_t posfile_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+posfile_t *posfile_open_shared(char *fname)
+{
+    posfile_cache_t *ent;
+
+    pthread_mutex_lock(&posfile_cache_lock);
+    for (ent = posfile_cache; ent; ent = ent->next) {
+        if (strcmp(ent->fname, fname) == 0) break;
+    }
+    if (!ent) {
+        ent = calloc(1, sizeof(posfile_cache_t));
+        ent->fname = strdup(fname);
+        ent->posfile = posfile_open(fname);
+        // each tile thread reads its own part of the file
+        if (ent->posfile->mapped) {
+            madvise(ent->posfile->data, ent->posfile->data_size, MADV_NORMAL);
+            madvise(ent->posfile->data, ent->posfile->data_size, MADV_WILLNEED);
+        }
+        ent->next = posfile_cache;
+        posfile_cache = ent;
+    }
+    pthread_mutex_unlock(&posfile_cache_lock);
+
+    posfile_t *posfile = malloc(sizeof(posfile_t));
+    *posfile = *ent->posfile;
+    posfile->fhandle = -1;
+    posfile->mapped = false;
+    posfile->shared = true;
+    if (posfile->errmsg) posfile->errmsg = strdup(posfile->errmsg);
+    return posfile;
+}
+
+/*
+ * Free all the shared files.
+ * There must not be any readers of them still open when this is called.
+ */
+void posfile_free_shared_cache(void)
+{
+    pthread_mutex_lock(&posfile_cache_lock);
+    while (posfile_cache) {
+        posfile_cache_t *ent = posfile_cache;
+        posfile_cache = ent->next;
+        posfile_close(ent->posfile);
+        free(ent->fname);
+        free(ent);
+    }
+    pthread_mutex_unlock(&posfile_cache_lock);
+}
+
+/*
+ * Convert a locs or pos file coordinate to the integer form used in read names
+ */
+static inline int locs_coord(float f)
+{
+    return 10 * f + 1000.5;
+}
+
 static int locs_next(posfile_t *posfile)
 {
     float dx, dy;
@@ -120,16 +239,10 @@ static int locs_next(posfile_t *posfile)
     if (posfile->current_block >= posfile->total_blocks) return -1;
     posfile->current_block++;
 
-    int n;
-    n = read(posfile->fhandle, (void *)&dx, 4);
-    n = read(posfile->fhandle, (void *)&dy, 4);
-    if (n<0) {
-        fprintf(stderr,"something has gone wrong in locs_next()\n");
-        exit(1);
-    }
+    if (posfile_get(posfile, &dx, 4) < 0 || posfile_get(posfile, &dy, 4) < 0) return -1;
 
-    posfile->x = 10 * dx + 1000.5;
-    posfile->y = 10 * dy + 1000.5;
+    posfile->x = locs_coord(dx);
+    posfile->y = locs_coord(dy);
 
     return 0;
 }
@@ -139,30 +252,170 @@ static int clocs_next(posfile_t *posfile)
     unsigned char dx, dy;
 
     while (posfile->unread_clusters == 0 && (posfile->current_block < posfile->total_blocks)) {
-        if (read(posfile->fhandle, (void *)&posfile->unread_clusters, 1) != 1) return -1;
+        if (posfile->pos >= posfile->data_size) return -1;
+        posfile->unread_clusters = posfile->data[posfile->pos++];
         posfile->current_block++;
     }
 
     if (posfile->unread_clusters == 0) return -1;
     posfile->unread_clusters--;
 
-    int n;
-    n = read(posfile->fhandle, (void *)&dx, 1);    
-    n = read(posfile->fhandle, (void *)&dy, 1);
-    if (n<0) {
-        fprintf(stderr,"something has gone wrong in clocs_next()\n");
-        exit(1);
-    }
+    if (posfile->pos + 2 > posfile->data_size) return -1;
+    dx = posfile->data[posfile->pos++];
+    dy = posfile->data[posfile->pos++];
 
     posfile->x = 10 * CLOCS_BLOCK_SIZE * ((posfile->current_block - 1) % CLOCS_BLOCKS_PER_LINE) + dx + 1000;
     posfile->y = 10 * CLOCS_BLOCK_SIZE * ((posfile->current_block - 1) / CLOCS_BLOCKS_PER_LINE) + dy + 1000;
     return 0;
 }
 
+/*
+ * Parse the next whitespace separated number from a _pos.txt file.
+ * The file isn't NUL terminated, so copy the number out before converting it.
+ * Returns 0 on success, -1 at the end of the file or on a parse error
+ */
+static int pos_get_float(posfile_t *posfile, float *f)
+{
+    char buf[64], *end;
+    int len = 0;
+
+    while (posfile->pos < posfile->data_size && isspace(posfile->data[posfile->pos])) posfile->pos++;
+    while (posfile->pos < posfile->data_size && !isspace(posfile->data[posfile->pos])) {
+        if (len == sizeof(buf) - 1) return -1;
+        buf[len++] = posfile->data[posfile->pos++];
+    }
+    if (len == 0) return -1;
+    buf[len] = 0;
+    *f = strtof(buf, &end);
+    return *end ? -1 : 0;
+}
+
+static int pos_next(posfile_t *posfile)
+{
+    float dx, dy;
+
+    if (pos_get_float(posfile, &dx) < 0 || pos_get_float(posfile, &dy) < 0) return -1;
+    posfile->current_block++;
+
+    posfile->x = locs_coord(dx);
+    posfile->y = locs_coord(dy);
+    return 0;
+}
+
 int posfile_next(posfile_t *posfile)
 {
     if (posfile->file_type == CLOCS) return clocs_next(posfile);
     if (posfile->file_type == LOCS) return locs_next(posfile);
+    if (posfile->file_type == POS) return pos_next(posfile);
     return -1;
 }
 
+/*
+ * Convert n (dx,dy) float pairs from a locs file into separate x and y arrays.
+ * The multiply is done in single precision and the add in double precision,
+ * exactly as locs_coord() does, so both give identical results.
+ */
+static void locs_convert(const float *src, int32_t *x, int32_t *y, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 ten = _mm_set1_ps(10.0f);
+    const __m128d offset = _mm_set1_pd(1000.5);
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(src + 2*i), ten);        // x0 y0 x1 y1
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(src + 2*i + 4), ten);    // x2 y2 x3 y3
+        __m128i a0 = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(a), offset));
+        __m128i a1 = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), offset));
+        __m128i b0 = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(b), offset));
+        __m128i b1 = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(b, b)), offset));
+        // x0 y0 x1 y1 -> x0 x1 y0 y1
+        __m128i lo = _mm_shuffle_epi32(_mm_unpacklo_epi64(a0, a1), _MM_SHUFFLE(3,1,2,0));
+        __m128i hi = _mm_shuffle_epi32(_mm_unpacklo_epi64(b0, b1), _MM_SHUFFLE(3,1,2,0));
+        _mm_storeu_si128((__m128i *)(x + i), _mm_unpacklo_epi64(lo, hi));
+        _mm_storeu_si128((__m128i *)(y + i), _mm_unpackhi_epi64(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] = locs_coord(src[2*i]);
+        y[i] = locs_coord(src[2*i+1]);
+    }
+}
+
+static int locs_load_tile(posfile_t *posfile, int32_t *x, int32_t *y, int n)
+{
+    float buf[512];
+    int count = 0;
+
+    if (posfile->current_block + n > posfile->total_blocks) n = posfile->total_blocks - posfile->current_block;
+    if (n > (posfile->data_size - posfile->pos) / 8) n = (posfile->data_size - posfile->pos) / 8;
+
+    // copy in small chunks, as the data may not be aligned
+    while (count < n) {
+        int chunk = n - count;
+        if (chunk > sizeof(buf) / 8) chunk = sizeof(buf) / 8;
+        memcpy(buf, posfile->data + posfile->pos, chunk * 8);
+        posfile->pos += chunk * 8;
+        locs_convert(buf, x + count, y + count, chunk);
+        count += chunk;
+    }
+    posfile->current_block += count;
+    return count;
+}
+
+static int clocs_load_tile(posfile_t *posfile, int32_t *x, int32_t *y, int n)
+{
+    const uint8_t *data = posfile->data;
+    size_t pos = posfile->pos;
+    int count = 0;
+
+    while (count < n) {
+        while (posfile->unread_clusters == 0 && posfile->current_block < posfile->total_blocks && pos < posfile->data_size) {
+            posfile->unread_clusters = data[pos++];
+            posfile->current_block++;
+        }
+        if (posfile->unread_clusters == 0) break;
+
+        int bx = 10 * CLOCS_BLOCK_SIZE * ((posfile->current_block - 1) % CLOCS_BLOCKS_PER_LINE) + 1000;
+        int by = 10 * CLOCS_BLOCK_SIZE * ((posfile->current_block - 1) / CLOCS_BLOCKS_PER_LINE) + 1000;
+        int m = posfile->unread_clusters;
+        if (m > n - count) m = n - count;
+        if (m > (posfile->data_size - pos) / 2) m = (posfile->data_size - pos) / 2;
+        if (m == 0) break;
+        for (int i = 0; i < m; i++, pos += 2) {
+            x[count+i] = bx + data[pos];
+            y[count+i] = by + data[pos+1];
+        }
+        posfile->unread_clusters -= m;
+        count += m;
+    }
+    posfile->pos = pos;
+    return count;
+}
+
+/*
+ * Decode the positions of the next n clusters into the x and y arrays.
+ * Returns the number of positions decoded, which is less than n at the end of the file.
+ * posfile->x and posfile->y are left at the last position decoded, as if posfile_next()
+ * had been called for each cluster.
+ */
+int posfile_load_tile(posfile_t *posfile, int32_t *x, int32_t *y, int n)
+{
+    int count = 0;
+
+    if (n <= 0) return 0;
+    if (posfile->file_type == CLOCS) count = clocs_load_tile(posfile, x, y, n);
+    if (posfile->file_type == LOCS) count = locs_load_tile(posfile, x, y, n);
+    if (posfile->file_type == POS) {
+        while (count < n && pos_next(posfile) == 0) {
+            x[count] = posfile->x;
+            y[count] = posfile->y;
+            count++;
+        }
+    }
+
+    if (count > 0) {
+        posfile->x = x[count-1];
+        posfile->y = y[count-1];
+    }
+    return count;
+}
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define __POSFILE_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #define CLOCS_BLOCK_SIZE 25
 #define CLOCS_IMAGE_WIDTH 2048
@@ -38,11 +40,20 @@ typedef struct {
     int current_block;
     uint8_t unread_clusters;
     int x,y;
+    // the whole file, mapped or read into memory
+    uint8_t *data;
+    size_t data_size;
+    size_t pos;
+    bool mapped;
+    bool shared;        // data belongs to the shared file cache
 } posfile_t;
 
 posfile_t *posfile_open(char *fname);
 int posfile_next(posfile_t *posfile);
+int posfile_load_tile(posfile_t *posfile, int32_t *x, int32_t *y, int n);
 void posfile_close(posfile_t *posfile);
+posfile_t *posfile_open_shared(char *fname);
+void posfile_free_shared_cache(void);
 void posfile_seek(posfile_t *posfile, int cluster);
 
 static inline int posfile_get_x(posfile_t *posfile) { return posfile->x; }
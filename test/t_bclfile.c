@@ -67,6 +67,159 @@ void icheckEqual(char *name, int expected, int actual)
     }
 }
 
+/*
+ * Load a whole file with bclfile_load_tile(), in two chunks (the first of
+ * size 'split'), and compare against bclfile_next()
+ */
+void checkLoadTile(char *name, char *fname, int nclusters, int split)
+{
+    char msg[128];
+    uint8_t *bases = calloc(1, nclusters+1);
+    uint8_t *quals = calloc(1, nclusters+1);
+    bclfile_t *bcl = bclfile_open(fname);
+    int r;
+
+    r = bclfile_load_tile(bcl, bases, quals, split);
+    sprintf(msg, "%s load_tile first chunk", name); icheckEqual(msg, split, r);
+    r = bclfile_load_tile(bcl, bases+split, quals+split, nclusters+1-split);
+    sprintf(msg, "%s load_tile second chunk", name); icheckEqual(msg, nclusters-split, r);
+    sprintf(msg, "%s load_tile at end", name); icheckEqual(msg, 0, bclfile_load_tile(bcl, bases, quals, 1));
+    bclfile_close(bcl);
+
+    bcl = bclfile_open(fname);
+    for (int n=0; n < nclusters; n++) {
+        bclfile_next(bcl);
+        if (bases[n] != bcl->base || (bcl->file_type != BCL_SCL && quals[n] != bcl->quality)) {
+            fprintf(stderr, "%s load_tile cluster %d: Expected: '%c' %d \tGot: '%c' %d\n", name, n, bcl->base, bcl->quality, bases[n], quals[n]);
+            failure++;
+            break;
+        }
+    }
+    bclfile_close(bcl);
+    free(bases); free(quals);
+}
+
+/*
+ * Check the vectorised CBCL decoders against the scalar one
+ */
+void checkDecoders(void)
+{
+    uint8_t src[1000];
+    uint8_t sb[2000], sq[2000], vb[2000], vq[2000];
+    uint8_t base_lut[16], qual_lut[16];
+
+    for (int n=0; n < 16; n++) {
+        qual_lut[n] = (n >> 2) * 10 + 33;
+        base_lut[n] = (n >> 2) ? "ACGT"[n & 0x03] : 'N';
+    }
+    srand(42);
+    for (int n=0; n < sizeof(src); n++) src[n] = rand() & 0xff;
+
+    cbcl_decode_scalar(src, sizeof(src), base_lut, qual_lut, sb, sq);
+    ccheckEqual("scalar decode low nibble", base_lut[src[0] & 0x0f], sb[0]);
+    ccheckEqual("scalar decode high nibble", base_lut[src[0] >> 4], sb[1]);
+
+    // odd lengths leave a tail for the scalar code
+    for (int len = 0; len < 100; len += 7) {
+        memset(vb, 0, sizeof(vb)); memset(vq, 0, sizeof(vq));
+        cbcl_decode(src, len, base_lut, qual_lut, vb, vq);
+        if (memcmp(sb, vb, 2*len) || memcmp(sq, vq, 2*len)) {
+            fprintf(stderr, "cbcl_decode() differs from scalar decode for length %d\n", len);
+            failure++;
+        }
+    }
+
+#ifdef BCL_X86_SIMD
+    if (__builtin_cpu_supports("ssse3")) {
+        int n = cbcl_decode_ssse3(src, sizeof(src), base_lut, qual_lut, vb, vq);
+        icheckEqual("ssse3 decode length", 992, n);
+        if (memcmp(sb, vb, 2*n) || memcmp(sq, vq, 2*n)) {
+            fprintf(stderr, "ssse3 decode differs from scalar decode\n");
+            failure++;
+        }
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        int n = cbcl_decode_avx2(src, sizeof(src), base_lut, qual_lut, vb, vq);
+        icheckEqual("avx2 decode length", 992, n);
+        if (memcmp(sb, vb, 2*n) || memcmp(sq, vq, 2*n)) {
+            fprintf(stderr, "avx2 decode differs from scalar decode\n");
+            failure++;
+        }
+    }
+#endif
+}
+
+/*
+ * Check each CBCL record width decoder against cbcl_record(), starting
+ * part way through a group of records and ending part way through another
+ */
+void checkRecordDecoders(void)
+{
+    uint8_t src[1000];
+    uint8_t base_lut[256], qual_lut[256];
+    uint8_t b[1000], q[1000];
+    char msg[128];
+
+    for (int n=0; n < 256; n++) {
+        base_lut[n] = n;
+        qual_lut[n] = n ^ 0x55;
+    }
+    for (int n=0; n < sizeof(src); n++) src[n] = rand() & 0xff;
+
+    for (int bits=4; bits <= 8; bits++) {
+        for (int first=0; first < 20; first += 3) {
+            int len = 900 - first;
+            cbcl_decoders[bits](src, first, len, base_lut, qual_lut, b, q);
+            for (int n=0; n < len; n++) {
+                unsigned v = cbcl_record(src, first+n, bits);
+                if (b[n] != v || q[n] != (v ^ 0x55)) {
+                    sprintf(msg, "%d bit decoder from %d", bits, first);
+                    icheckEqual(msg, v, b[n]);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Write a single tile CBCL file with the given record layout and no quality bins
+ */
+void writeCBCL(char *fname, int bits_per_qual, uint8_t *records, int nclusters, uint8_t pf)
+{
+    int bits = 2 + bits_per_qual;
+    uint32_t usize = (nclusters * bits + 7) / 8;
+    uint8_t *block = calloc(1, usize);
+    uint8_t cblock[4096];
+    z_stream zs;
+    FILE *fp;
+
+    for (int n=0; n < nclusters; n++) {
+        int bit = n * bits;
+        block[bit/8] |= records[n] << (bit % 8);
+        if (bit % 8 + bits > 8) block[bit/8 + 1] |= records[n] >> (8 - bit % 8);
+    }
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = block; zs.avail_in = usize;
+    zs.next_out = cblock; zs.avail_out = sizeof(cblock);
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    uint16_t version = 1;
+    uint32_t header_size = 2+4+1+1+4+4+16+1, nbins = 0, ntiles = 1;
+    uint32_t tilerec[4] = { 1101, nclusters, usize, zs.total_out };
+    uint8_t bpb = 2, bpq = bits_per_qual;
+    fp = fopen(fname, "w");
+    fwrite(&version, 2, 1, fp); fwrite(&header_size, 4, 1, fp);
+    fwrite(&bpb, 1, 1, fp); fwrite(&bpq, 1, 1, fp);
+    fwrite(&nbins, 4, 1, fp); fwrite(&ntiles, 4, 1, fp);
+    fwrite(tilerec, 4, 4, fp); fwrite(&pf, 1, 1, fp);
+    fwrite(cblock, zs.total_out, 1, fp);
+    fclose(fp);
+    free(block);
+}
+
 int main(int argc, char**argv)
 {
     int n;
@@ -104,6 +257,78 @@ int main(int argc, char**argv)
 
     bclfile_close(bclfile);
 
+    // seeking in a (gzipped) BCL file
+
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.bcl"));
+    bclfile_seek(bclfile, 306);
+    bclfile_next(bclfile);
+    ccheckEqual("seek 307 Base", 'A', bclfile->base);
+    icheckEqual("seek 307 Quality", 30, bclfile->quality);
+
+    bclfile_seek(bclfile, 2609911);
+    icheckEqual("seek last next", 0, bclfile_next(bclfile));
+    ccheckEqual("seek last Base", 'G', bclfile->base);
+    icheckEqual("seek last Quality", 20, bclfile->quality);
+    icheckEqual("seek past end", -1, bclfile_next(bclfile));
+    bclfile_close(bclfile);
+
+    // BGZF: the NextSeq test data is a single block, so write the BCL file
+    // above as a multi block BGZF file too
+
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/160919_nextseq_6230_FC/Data/Intensities/BaseCalls/L001/0001.bcl"));
+    if (!bclfile->bgzfhandle) {
+        fprintf(stderr,"0001.bcl.bgzf was not opened as BGZF\n");
+        failure++;
+    }
+    {
+        uint8_t b[200], q[200];
+        icheckEqual("BGZF load", 200, bclfile_load_tile(bclfile, b, q, 200));
+        bclfile_seek(bclfile, 150);
+        bclfile_next(bclfile);
+        ccheckEqual("BGZF seek Base", b[150], bclfile->base);
+        icheckEqual("BGZF seek Quality", q[150], bclfile->quality);
+    }
+    bclfile_close(bclfile);
+
+    {
+        char template[] = "/tmp/bambi.XXXXXX";
+        char *TMPDIR = mkdtemp(template);
+        char fname[512], bgzfname[512];
+        char *data = malloc(4 + 2609912);
+        gzFile gz = gzopen(MKNAME(DATA_DIR,"/s_1_1101.bcl.gz"), "r");
+        int len = gzread(gz, data, 4 + 2609912);
+        gzclose(gz);
+        sprintf(fname, "%s/s_1_1101.bcl", TMPDIR);
+        sprintf(bgzfname, "%s.bgzf", fname);
+        BGZF *fp = bgzf_open(bgzfname, "w");
+        bgzf_write(fp, data, len);
+        bgzf_close(fp);
+
+        bclfile = bclfile_open(fname);
+        icheckEqual("multi block BGZF Total clusters", 2609912, bclfile->total_clusters);
+        bclfile_seek(bclfile, 2609911);
+        bclfile_next(bclfile);
+        ccheckEqual("multi block BGZF last Base", 'G', bclfile->base);
+        icheckEqual("multi block BGZF last Quality", 20, bclfile->quality);
+        if (bclfile->nblocks < 2) {
+            fprintf(stderr, "multi block BGZF: only %d blocks\n", bclfile->nblocks);
+            failure++;
+        }
+        for (n=306; n < 2609912; n += 99991) {
+            bclfile_seek(bclfile, n);
+            bclfile_next(bclfile);
+            if (bclfile->quality != (((uint8_t)data[4+n]) >> 2)) {
+                fprintf(stderr, "multi block BGZF seek %d: Expected: %d \tGot: %d\n", n, ((uint8_t)data[4+n]) >> 2, bclfile->quality);
+                failure++;
+            }
+        }
+        bclfile_close(bclfile);
+
+        unlink(bgzfname);
+        rmdir(TMPDIR);
+        free(data);
+    }
+
     // SCL tests
 
     bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.scl"));
@@ -125,6 +350,19 @@ int main(int argc, char**argv)
 
     while (bclfile_next(bclfile) == 0);
     ccheckEqual("SCL Last Base", 'C', bclfile->base);
+    bclfile_close(bclfile);
+
+    // SCL with a tiny read buffer, to check the buffer is refilled correctly
+
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.scl"));
+    bclfile_set_buffer_size(bclfile, 7);
+    for (n=0; n<307; n++) {
+        bclfile_next(bclfile);
+    }
+    ccheckEqual("SCL small buffer 307 Base", 'T', bclfile->base);
+    while (bclfile_next(bclfile) == 0);
+    ccheckEqual("SCL small buffer Last Base", 'C', bclfile->base);
+    bclfile_close(bclfile);
 
     // CBCL tests
 
@@ -154,6 +392,210 @@ int main(int argc, char**argv)
 
     icheckEqual("CBCL current_block_size", 14, bclfile->current_block_size);
 
+    // a second open shares the cached header
+    {
+        bclfile_t *b2 = bclfile_open(bclfile->filename);
+        if (b2->header != bclfile->header) {
+            fprintf(stderr, "CBCL header was not shared between handles\n");
+            failure++;
+        }
+        icheckEqual("CBCL cached tile offset", 65, b2->header->tile_offset[0]);
+        icheckEqual("CBCL cached end offset", 65 + ((tilerec_t *)b2->tiles->entries[0])->compressed_blocksize, b2->header->tile_offset[1]);
+        bclfile_close(b2);
+    }
+    bclfile_close(bclfile);
+
+    // bulk loading must give the same results as bclfile_next()
+
+    checkLoadTile("BCL", MKNAME(DATA_DIR,"/s_1_1101.bcl"), 2609912, 1000);
+    checkLoadTile("SCL", MKNAME(DATA_DIR,"/s_1_1101.scl"), 2609912, 1000);
+    checkLoadTile("CBCL", MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl"), 28, 3);
+    checkLoadTile("CBCL surface 2", MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C2.1/L001_2.cbcl"), 28, 5);
+
+    checkDecoders();
+    checkRecordDecoders();
+
+    // CBCL files with wider quality scores
+    {
+        char template[] = "/tmp/bambi.XXXXXX";
+        char *TMPDIR = mkdtemp(template);
+        char fname[512], msg[128];
+        uint8_t records[101], b[101], q[101];
+
+        for (int bpq=2; bpq <= 6; bpq++) {
+            for (n=0; n < 101; n++) records[n] = rand() & ((1 << (2+bpq)) - 1);
+            sprintf(fname, "%s/L001_%d.cbcl", TMPDIR, bpq);
+            writeCBCL(fname, bpq, records, 101, 0);
+            bclfile = bclfile_open(fname);
+            sprintf(msg, "CBCL 2/%d open", bpq); icheckEqual(msg, 1, bclfile != NULL);
+            sprintf(msg, "CBCL 2/%d load_tile", bpq); icheckEqual(msg, 101, bclfile_load_tile(bclfile, b, q, 101));
+            for (n=0; n < 101; n++) {
+                int qual = records[n] >> 2;
+                char base = qual ? "ACGT"[records[n] & 3] : 'N';
+                if (b[n] != base || q[n] != qual) {
+                    fprintf(stderr, "CBCL 2/%d cluster %d: Expected: '%c' %d \tGot: '%c' %d\n", bpq, n, base, qual, b[n], q[n]);
+                    failure++;
+                    break;
+                }
+            }
+            bclfile_close(bclfile);
+            checkLoadTile(msg, fname, 101, 37);
+            unlink(fname);
+        }
+        rmdir(TMPDIR);
+    }
+
+    // seeking to a cluster must give the same clusters as reading up to it, with and without the pfFlag
+    {
+        char template[] = "/tmp/bambi.XXXXXX";
+        char *TMPDIR = mkdtemp(template);
+        char fname[512], msg[128];
+        uint8_t records[101], b[101], q[101];
+        int starts[] = { 0, 1, 36, 37, 100 };
+
+        for (int pf=0; pf <= 1; pf++) {
+            for (n=0; n < 101; n++) records[n] = rand() & 0x0f;
+            sprintf(fname, "%s/L001_pf%d.cbcl", TMPDIR, pf);
+            writeCBCL(fname, 2, records, 101, pf);
+            bclfile = bclfile_open(fname);
+            sprintf(msg, "CBCL pf=%d pfFlag", pf); icheckEqual(msg, pf, bclfile->pfFlag);
+            for (n=0; n < 101; n++) {
+                bclfile_next(bclfile);
+                b[n] = bclfile->base; q[n] = bclfile->quality;
+            }
+            bclfile_close(bclfile);
+
+            for (int i=0; i < sizeof(starts)/sizeof(starts[0]); i++) {
+                int start = starts[i];
+                bclfile = bclfile_open(fname);
+                bclfile_seek_tile(bclfile, 1101);
+                sprintf(msg, "CBCL pf=%d seek_cluster(%d)", pf, start); icheckEqual(msg, 0, bclfile_seek_cluster(bclfile, start));
+                for (n=start; n < 101; n++) {
+                    if (bclfile_next(bclfile) < 0 || bclfile->base != b[n] || bclfile->quality != q[n]) {
+                        fprintf(stderr, "%s cluster %d: Expected: '%c' %d \tGot: '%c' %d\n", msg, n, b[n], q[n], bclfile->base, bclfile->quality);
+                        failure++;
+                        break;
+                    }
+                }
+                sprintf(msg, "CBCL pf=%d seek_cluster(%d) end", pf, start); icheckEqual(msg, -1, bclfile_next(bclfile));
+                bclfile_close(bclfile);
+            }
+            unlink(fname);
+        }
+        rmdir(TMPDIR);
+    }
+
+    // and in a real CBCL file
+    {
+        char *fname = MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl");
+        uint8_t b[28], q[28];
+
+        bclfile = bclfile_open(fname);
+        for (n=0; n < 28; n++) {
+            bclfile_next(bclfile);
+            b[n] = bclfile->base; q[n] = bclfile->quality;
+        }
+        bclfile_close(bclfile);
+        for (int start=0; start < 28; start += 9) {
+            bclfile = bclfile_open(fname);
+            bclfile_seek_tile(bclfile, 1101);
+            bclfile_seek_cluster(bclfile, start);
+            for (n=start; n < 28; n++) {
+                if (bclfile_next(bclfile) < 0 || bclfile->base != b[n] || bclfile->quality != q[n]) {
+                    fprintf(stderr, "CBCL seek_cluster(%d) cluster %d: Expected: '%c' %d \tGot: '%c' %d\n", start, n, b[n], q[n], bclfile->base, bclfile->quality);
+                    failure++;
+                    break;
+                }
+            }
+            bclfile_close(bclfile);
+        }
+    }
+
+    // seek lots of CBCL files in parallel, and check we get the same blocks as a single seek,
+    // with and without a pool of threads
+    {
+        bclfile_pool_t *pool = bclfile_pool_init(3);
+        char fname[512], msg[128];
+        for (int p=0; p < 2; p++) {
+            va_t *bcls = va_init(10, (void (*)(void *))bclfile_close);
+            for (n=1; n <= 20; n++) {
+                sprintf(fname, "%s/C%d.1/L001_1.cbcl", MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001"), n);
+                va_push(bcls, bclfile_open(fname));
+            }
+            sprintf(msg, "seek_tiles %s pool", p ? "with" : "without");
+            icheckEqual(msg, 0, bclfile_seek_tiles(bcls, 1101, p ? pool : NULL));
+            for (n=0; n < bcls->end; n++) {
+                bclfile_t *bcl = bcls->entries[n];
+                bclfile_t *single = bclfile_open(bcl->filename);
+                bclfile_seek_tile(single, 1101);
+                if (!bcl->current_block || bcl->current_block_size != single->current_block_size ||
+                    memcmp(bcl->current_block, single->current_block, single->current_block_size)) {
+                    fprintf(stderr, "%s: block differs for %s\n", msg, bcl->filename);
+                    failure++;
+                }
+                bclfile_close(single);
+            }
+            sprintf(msg, "seek_tiles %s pool, no such tile", p ? "with" : "without");
+            icheckEqual(msg, -1, bclfile_seek_tiles(bcls, 1199, p ? pool : NULL));
+            va_free(bcls);
+        }
+        bclfile_pool_destroy(pool);
+    }
+
+    // memory mapped CBCL files must give the same blocks
+    {
+        char *fname = MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C2.1/L001_2.cbcl");
+        char *expected;
+        int size;
+
+        // this file only holds tile 1102, so it is read as surface 1
+        bclfile = bclfile_open(fname);
+        size = bclfile_seek_tile(bclfile, 1102);
+        icheckEqual("seek_tile size", bclfile->current_block_size, size);
+        if (size <= 0 || !bclfile->current_block) {
+            fprintf(stderr, "seek_tile: tile 1102 wasn't inflated from %s\n", fname);
+            failure++;
+            size = 0;
+        }
+        expected = malloc(size + 1);
+        if (size) memcpy(expected, bclfile->current_block, size);
+        bclfile_close(bclfile);
+
+        bclfile_free_header_cache();
+        bclfile_set_mmap(true);
+        bclfile = bclfile_open(fname);
+        if (!bclfile->header->map) {
+            fprintf(stderr, "mmap: %s was not mapped\n", fname);
+            failure++;
+        }
+        icheckEqual("mmap seek_tile", size, bclfile_seek_tile(bclfile, 1102));
+        if (!size || !bclfile->current_block || memcmp(expected, bclfile->current_block, size)) {
+            fprintf(stderr, "mmap: block differs for %s\n", fname);
+            failure++;
+        }
+        bclfile_close(bclfile);
+        bclfile_free_header_cache();
+        bclfile_set_mmap(false);
+        free(expected);
+    }
+
+    // decode a whole block with Phred+33 qualities
+    {
+        uint8_t bases[28], quals[28];
+        bclfile = bclfile_open(MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl"));
+        icheckEqual("CBCL decode_block", 28, bclfile_decode_block(bclfile, bases, quals, 33));
+        for (n=0; n < 28; n++) {
+            bclfile_next(bclfile);
+            if (bases[n] != bclfile->base || quals[n] != bclfile->quality + 33) {
+                fprintf(stderr, "decode_block cluster %d: Expected: '%c' %d \tGot: '%c' %d\n", n, bclfile->base, bclfile->quality+33, bases[n], quals[n]);
+                failure++;
+                break;
+            }
+        }
+        bclfile_close(bclfile);
+    }
+
+    bclfile_free_header_cache();
     printf("bclfile tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
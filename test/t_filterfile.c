@@ -90,6 +90,14 @@ int main(int argc, char**argv)
     icheckEqual("Last Current cluster", 2000, filter->current_cluster);
     icheckEqual("Last Current PF clusters", 977, filter->current_pf_cluster);
     icheckEqual("Last Total clusters", 2000, filter->total_clusters);
+
+    // seeking is relative to the start of the cluster data
+    filter_seek(filter, 318);
+    icheckEqual("seek 319 entry", 1, filter_next(filter));
+    filter_seek(filter, 0);
+    icheckEqual("seek first entry", 0, filter_next(filter));
+    filter_seek(filter, 2000);
+    icheckEqual("seek past end", -1, filter_next(filter));
     filter_close(filter);
 
     // 10X filter file
@@ -101,6 +109,45 @@ int main(int argc, char**argv)
     icheckEqual("novaseq Total clusters", 28, filter->total_clusters);
     filter_close(filter);
 
+    // bulk load: bitmap must match filter_next(), across odd sized batches
+    {
+        filter_t *f1 = filter_open(MKNAME(DATA_DIR,"/s_1_1101.filter"));
+        filter_t *f2 = filter_open(MKNAME(DATA_DIR,"/s_1_1101.filter"));
+        uint64_t pf[4];
+        int r, diffs = 0;
+        while ((r = filter_load_tile(f2, pf, 201)) > 0) {
+            for (int c=0; c < r; c++) {
+                if (filter_next(f1) != ((pf[c/64] >> (c%64)) & 1)) diffs++;
+            }
+            if (r % 64 && (pf[r/64] >> (r%64))) diffs++;
+        }
+        icheckEqual("load_tile diffs", 0, diffs);
+        icheckEqual("load_tile Current cluster", 2000, f2->current_cluster);
+        icheckEqual("load_tile Current PF clusters", 977, f2->current_pf_cluster);
+        icheckEqual("load_tile at end", -1, filter_next(f1));
+        filter_close(f1);
+        filter_close(f2);
+    }
+
+    // shared files: each reader has its own position over the same data
+    {
+        filter_t *f1 = filter_open_shared(MKNAME(DATA_DIR,"/s_1_1101.filter"));
+        filter_t *f2 = filter_open_shared(MKNAME(DATA_DIR,"/s_1_1101.filter"));
+        icheckEqual("shared data", 1, f1->data == f2->data);
+        icheckEqual("shared Total clusters", 2000, f2->total_clusters);
+        filter_seek(f1, 318);
+        icheckEqual("shared seek 319 entry", 1, filter_next(f1));
+        icheckEqual("shared first entry", 0, filter_next(f2));
+        filter_close(f1);
+        icheckEqual("shared after close", 1, filter_next(f2));
+        filter_close(f2);
+
+        f1 = filter_open_shared(MKNAME(DATA_DIR,"/no_such_file.filter"));
+        checkLike("shared missing file", "No such file", f1->errmsg);
+        filter_close(f1);
+        filter_free_shared_cache();
+    }
+
     printf("filter tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -101,6 +101,13 @@ void setup_param_test(int* argc, char*** argv)
     (*argv)[(*argc)++] = strdup("--final-index-cycle");
     (*argv)[(*argc)++] = strdup("1");
     (*argv)[(*argc)++] = strdup("-S");
+    (*argv)[(*argc)++] = strdup("--tile-order");
+    (*argv)[(*argc)++] = strdup("--reorder-window");
+    (*argv)[(*argc)++] = strdup("500");
+    (*argv)[(*argc)++] = strdup("--compression-threads");
+    (*argv)[(*argc)++] = strdup("2");
+    (*argv)[(*argc)++] = strdup("--progress-interval");
+    (*argv)[(*argc)++] = strdup("5");
 
     assert(*argc<100);
 }
@@ -542,10 +549,151 @@ void test_paramaters(void)
     icheckEqual("options: final-index-cycle", 1, opts->final_index_cycle->end);
     icheckEqual("options: final-cycle[0]", 16, opts->final_cycle->entries[0]);
     icheckEqual("options: index-separator", 0, opts->separator);
+    icheckEqual("options: tile-order", 1, opts->tile_order);
+    icheckEqual("options: reorder-window", 500, opts->reorder_window);
+    icheckEqual("options: compression-threads", 2, opts->compression_threads);
+    icheckEqual("options: progress-interval", 5, opts->progress_interval);
+    icheckEqual("options: lanes", 1, opts->lanes->end);
     free_args(argv_1);
     i2b_free_opts(opts);
 }
 
+void test_lanes(void)
+{
+    char *argv[] = { "bambi", "i2b", "-i", MKNAME(DATA_DIR,"/160916_miseq_0966_FC/Data/Intensities"),
+                     "-o", "test/data/out/lane_%d.sam", "--lane", "3,1", NULL };
+    opts_t *opts = i2b_parse_args(7, argv+1);
+
+    if (verbose) printf("Testing lanes\n");
+
+    if (!opts) {
+        fprintf(stderr, "parse_args failed\n");
+        failure++;
+        return;
+    }
+
+    icheckEqual("lanes: number of lanes", 2, opts->lanes->end);
+    icheckEqual("lanes: lanes[0]", 3, opts->lanes->entries[0]);
+    icheckEqual("lanes: lanes[1]", 1, opts->lanes->entries[1]);
+    icheckEqual("lanes: lane", 3, opts->lane);
+
+    lane_t *lane = newLane(opts, 1);
+    checkEqual("lanes: output file", "test/data/out/lane_1.sam", lane->opts->output_file);
+    checkEqual("lanes: platform unit", "160916_miseq_0966_FC_1", lane->opts->platform_unit);
+    freeLane(lane);
+
+    char *fname = laneFileName("%d/x_%d.bam", 12);
+    checkEqual("lanes: file name", "12/x_12.bam", fname);
+    free(fname);
+
+    i2b_free_opts(opts);
+}
+
+/*
+ * Each cycle of a NovaSeq tile is read from the one CBCL file which holds its surface
+ */
+void test_bcl_files(void)
+{
+    int argc_1;
+    char** argv_1;
+    bool novaSeq;
+
+    if (verbose) printf("Testing bcl files\n");
+
+    novaseq_test(&argc_1, &argv_1, "test/data/out/xxx.bam", false);
+    opts_t *opts = i2b_parse_args(argc_1-1, argv_1+1);
+    if (!opts) {
+        fprintf(stderr, "parse_args failed\n");
+        failure++;
+        free_args(argv_1);
+        return;
+    }
+
+    machineType = -1;
+    va_t *cycleRange = getCycleRange(opts);
+    va_t *bclReadArray = openBclFiles(cycleRange, opts, 1101, NULL, &novaSeq, NULL, NULL);
+    icheckEqual("bcl files: novaSeq", 1, novaSeq);
+    icheckEqual("bcl files: reads", cycleRange->end, bclReadArray->end);
+    for (int n=0; n < bclReadArray->end && n < cycleRange->end; n++) {
+        cycleRangeEntry_t *cr = cycleRange->entries[n];
+        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+        icheckEqual("bcl files: one file per cycle", cr->last - cr->first + 1, ra->bclFileArray->end);
+        for (int i=0; i < ra->bclFileArray->end; i++) {
+            bclfile_t *bcl = ra->bclFileArray->entries[i];
+            icheckEqual("bcl files: surface", 1, bcl->surface);
+        }
+    }
+    machineType = -1;
+
+    va_free(bclReadArray);
+    va_free(cycleRange);
+    i2b_free_opts(opts);
+    free_args(argv_1);
+}
+
+/*
+ * A cycle of a CBCL file which only holds the clusters which passed the filter can't be
+ * stored while its filter file is still being written
+ */
+void test_live_filter(char *tmpdir)
+{
+    char *cbcl = MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl");
+    char *fname = MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/s_1_1101.filter");
+    char *short_fname = calloc(1,strlen(tmpdir)+64);
+    char command[1024];
+
+    if (verbose) printf("Testing live filter\n");
+
+    sprintf(short_fname, "%s/short.filter", tmpdir);
+    sprintf(command, "head -c 30 %s > %s", fname, short_fname);
+    if (system(command)) { fprintf(stderr,"Can't write %s\n", short_fname); failure++; }
+
+    for (int complete = 0; complete <= 1; complete++) {
+        bclfile_t *bcl = bclfile_open(cbcl);
+        filter_t *filter = filter_open(complete ? fname : short_fname);
+        int n = filter->total_clusters;
+        uint8_t *out = calloc(1, n);
+        bcl->pfFlag = 1;    // this file holds every cluster, but only the ones which passed will be read
+        icheckEqual("live filter: seek tile", 0, bclfile_seek_tile(bcl, 1101) < 0);
+        icheckEqual(complete ? "live filter: complete filter file" : "live filter: short filter file",
+                    complete, readLiveCycle(bcl, filter, n, out));
+        free(out);
+        filter_close(filter);
+        bclfile_close(bcl);
+    }
+    free(short_fname);
+}
+
+/*
+ * Move the cycles held back from a copy of a run folder into it one at a time, as the
+ * instrument would write them, and then mark the run as complete
+ */
+typedef struct {
+    char *run_folder;
+    char *pending;
+    int first_cycle, last_cycle;
+} liveCopy_t;
+
+void *liveCopier(void *arg)
+{
+    liveCopy_t *lc = (liveCopy_t *)arg;
+    char from[1024], to[1024];
+
+    for (int cycle = lc->first_cycle; cycle <= lc->last_cycle; cycle++) {
+        usleep(20000);
+        sprintf(from, "%s/C%d.1", lc->pending, cycle);
+        sprintf(to, "%s/Data/Intensities/BaseCalls/L001/C%d.1", lc->run_folder, cycle);
+        if (rename(from, to)) {
+            fprintf(stderr, "Can't move %s to %s: %s\n", from, to, strerror(errno));
+            failure++;
+        }
+    }
+    sprintf(to, "%s/RTAComplete.txt", lc->run_folder);
+    FILE *fp = fopen(to, "w");
+    if (fp) fclose(fp);
+    return NULL;
+}
+
 void checkFiles(char *name, char *outputfile, char *fname)
 {
     char command[1024];
@@ -590,6 +738,26 @@ void checkFiles(char *name, char *outputfile, char *fname)
     }
 }
 
+/*
+ * Check that two files have all the same records, in the same order
+ */
+void checkRecords(char *name, char *outputfile, char *fname)
+{
+    char command[1024];
+
+    sprintf(command,"samtools view %s > %s.got.txt", outputfile, outputfile);
+    if (system(command)) { fprintf(stderr,"samtools failed\n"); failure++; }
+    sprintf(command,"samtools view %s > %s.expected.txt", fname, outputfile);
+    if (system(command)) { fprintf(stderr,"samtools failed\n"); failure++; }
+    sprintf(command,"diff %s.got.txt %s.expected.txt", outputfile, outputfile);
+    if (system(command)) {
+        fprintf(stderr, "%s: records differ\n", name);
+        failure++;
+    } else {
+        success++;
+    }
+}
+
 int main(int argc, char**argv)
 {
     char template[] = "/tmp/bambi.XXXXXX";
@@ -616,6 +784,7 @@ int main(int argc, char**argv)
         if (verbose) fprintf(stderr,"Created temporary directory: %s\n", TMPDIR);
     }
     char *outputfile = calloc(1,strlen(TMPDIR)+64);
+    char *outputfile2 = calloc(1,strlen(TMPDIR)+64);
 
     int argc_1;
     char** argv_1;
@@ -630,6 +799,9 @@ int main(int argc, char**argv)
     // test that we can read the command line paramaters
     //
     test_paramaters();
+    test_lanes();
+    test_bcl_files();
+    test_live_filter(TMPDIR);
 
 
     //
@@ -643,6 +815,313 @@ int main(int argc, char**argv)
     checkFiles("Simple test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
     free_args(argv_1);
 
+    //
+    // simple test again, with fewer threads than there are jobs to do: there must still be a worker
+    //
+
+    if (verbose) fprintf(stderr,"\n===> One thread test\n");
+    sprintf(outputfile,"%s/i2b_threads.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("1");
+    icheckEqual("One thread: return code", 0, main_i2b(argc_1-1, argv_1+1));
+    checkFiles("One thread test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // simple test again, in tile order through a reorder buffer so small that the records spill to disk.
+    // Only the first piece of the tile can be written straight away, so split the tile to make more.
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Tile order test\n");
+    sprintf(outputfile,"%s/i2b_order.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-order");
+    argv_1[argc_1++] = strdup("--reorder-window");
+    argv_1[argc_1++] = strdup("1");
+    argv_1[argc_1++] = strdup("--min-split-clusters");
+    argv_1[argc_1++] = strdup("4");
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("8");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Tile order test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    sprintf(outputfile2,"%s/i2b_1.bam",TMPDIR);
+    checkRecords("Tile order test", outputfile, outputfile2);
+    free_args(argv_1);
+
+    //
+    // and with several tiles, which must wait for the ones before them.
+    // A single worker converts the tiles in order, to give the expected output.
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Tile order test, several tiles\n");
+    sprintf(outputfile2,"%s/i2b_order2_expected.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile2, verbose);
+    argv_1[argc_1++] = strdup("--tile-limit");
+    argv_1[argc_1++] = strdup("4");
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("3");
+    main_i2b(argc_1-1, argv_1+1);
+    free_args(argv_1);
+
+    sprintf(outputfile,"%s/i2b_order2.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-limit");
+    argv_1[argc_1++] = strdup("4");
+    argv_1[argc_1++] = strdup("--tile-order");
+    argv_1[argc_1++] = strdup("--reorder-window");
+    argv_1[argc_1++] = strdup("1");
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("8");
+    main_i2b(argc_1-1, argv_1+1);
+    checkRecords("Tile order test, several tiles", outputfile, outputfile2);
+    free_args(argv_1);
+
+    //
+    // simple test again, with idle workers taking ranges of clusters from the tile
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Split test\n");
+    sprintf(outputfile,"%s/i2b_split.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-order");
+    argv_1[argc_1++] = strdup("--min-split-clusters");
+    argv_1[argc_1++] = strdup("4");
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("8");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Split test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // several lanes: lane 2 of a copy of the run is lane 1 again. The tiles of both are only listed
+    // in RunInfo.xml, which must still hold lane 2's tiles once lane 1's have been read from it.
+    // The read names and platform unit of lane 2 are changed back to compare it with lane 1's output.
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Lanes test\n");
+    {
+        char command[1024];
+        char *run_folder = calloc(1,strlen(TMPDIR)+64);
+        char *runinfo = calloc(1,strlen(TMPDIR)+64);
+
+        // the run folder keeps its name, as it is part of the platform unit
+        sprintf(run_folder, "%s/lanes/160916_miseq_0966_FC", TMPDIR);
+        sprintf(command, "mkdir -p %s/lanes && cp -r %s %s/lanes", TMPDIR, MKNAME(DATA_DIR,"/160916_miseq_0966_FC"), TMPDIR);
+        if (system(command)) { fprintf(stderr,"Can't copy the run folder\n"); failure++; }
+        sprintf(command, "cd %s/Data/Intensities && cp -r L001 L002 && cp -r BaseCalls/L001 BaseCalls/L002 && "
+                         "for f in $(find L002 BaseCalls/L002 -name 's_1_*'); do mv $f $(echo $f | sed 's/s_1_/s_2_/'); done",
+                         run_folder);
+        if (system(command)) { fprintf(stderr,"Can't make lane 2\n"); failure++; }
+        sprintf(runinfo, "%s/RunInfo.xml", run_folder);
+        FILE *fp = fopen(runinfo, "w");
+        if (!fp) { fprintf(stderr,"Can't write %s\n", runinfo); failure++; }
+        else {
+            fprintf(fp, "<?xml version=\"1.0\" ?>\n<RunInfo Version=\"4\">\n  <Run Id=\"160919_miseq_5540\" Number=\"2\">\n"
+                        "    <Reads>\n      <Read IsIndexedRead=\"N\" NumCycles=\"16\" Number=\"1\"/>\n"
+                        "      <Read IsIndexedRead=\"N\" NumCycles=\"16\" Number=\"2\"/>\n    </Reads>\n"
+                        "    <FlowcellLayout LaneCount=\"2\">\n"
+                        "      <TileSet TileNamingConvention=\"FourDigit\">\n        <Tiles>\n");
+            for (int lane = 1; lane <= 2; lane++) {
+                fprintf(fp, "          <Tile>%d_1101</Tile>\n          <Tile>%d_1102</Tile>\n", lane, lane);
+            }
+            fprintf(fp, "        </Tiles>\n      </TileSet>\n    </FlowcellLayout>\n  </Run>\n"
+                        "  <Flowcell>TESTFLOWCELL</Flowcell>\n  <Instrument>miseq</Instrument>\n</RunInfo>\n");
+            fclose(fp);
+        }
+
+        sprintf(outputfile,"%s/i2b_lane_%%d.bam",TMPDIR);
+        setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+        free(argv_1[3]);    // the intensities directory
+        argv_1[3] = calloc(1,strlen(run_folder)+64);
+        sprintf(argv_1[3], "%s/Data/Intensities", run_folder);
+        free(argv_1[7]);    // the lane
+        argv_1[7] = strdup("1,2");
+        icheckEqual("Lanes: return code", 0, main_i2b(argc_1-1, argv_1+1));
+
+        sprintf(outputfile,"%s/i2b_lane_1.bam",TMPDIR);
+        checkFiles("Lanes test, lane 1", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+        sprintf(outputfile2,"%s/i2b_lane_2_as_1.bam",TMPDIR);
+        sprintf(command, "samtools view -h %s/i2b_lane_2.bam | sed -e 's/^\\([^:]*\\):2:/\\1:1:/' -e 's/PU:160916_miseq_0966_FC_2/PU:160916_miseq_0966_FC_1/' | samtools view -b -o %s -",
+                         TMPDIR, outputfile2);
+        if (system(command)) { fprintf(stderr,"samtools failed\n"); failure++; }
+        checkFiles("Lanes test, lane 2", outputfile2, MKNAME(DATA_DIR,"/out/test1.bam"));
+        checkRecords("Lanes test, lane 2", outputfile2, outputfile);
+
+        free_args(argv_1);
+        free(run_folder);
+        free(runinfo);
+    }
+
+    //
+    // simple test again, through the live store
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Live test\n");
+    sprintf(outputfile,"%s/i2b_live.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--live");
+    argv_1[argc_1] = calloc(1,strlen(TMPDIR)+64);
+    sprintf(argv_1[argc_1++], "%s/live", TMPDIR);
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Live test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // and while the run is being written: start with the first three cycles, and add the rest as they are converted
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Live test, while the run is being written\n");
+    {
+        char command[1024];
+        char *run_folder = calloc(1,strlen(TMPDIR)+64);
+        char *pending = calloc(1,strlen(TMPDIR)+64);
+        char *store = calloc(1,strlen(TMPDIR)+64);
+        char *stored = calloc(1,strlen(TMPDIR)+64);
+        char fname[1024];
+        liveCopy_t lc;
+        pthread_t copier;
+        struct stat before, after;
+
+        // the run folder keeps its name, as it is part of the platform unit
+        sprintf(run_folder, "%s/run/160916_miseq_0966_FC", TMPDIR);
+        sprintf(pending, "%s/pending", TMPDIR);
+        sprintf(store, "%s/live_store", TMPDIR);
+        sprintf(command, "mkdir -p %s/run %s && cp -r %s %s/run", TMPDIR, pending, MKNAME(DATA_DIR,"/160916_miseq_0966_FC"), TMPDIR);
+        if (system(command)) { fprintf(stderr,"Can't copy the run folder\n"); failure++; }
+        lc.run_folder = run_folder;
+        lc.pending = pending;
+        lc.first_cycle = 4;
+        for (lc.last_cycle = lc.first_cycle; ; lc.last_cycle++) {
+            char to[1024];
+            sprintf(fname, "%s/Data/Intensities/BaseCalls/L001/C%d.1", run_folder, lc.last_cycle);
+            sprintf(to, "%s/C%d.1", pending, lc.last_cycle);
+            if (rename(fname, to)) break;
+        }
+        lc.last_cycle--;
+
+        sprintf(outputfile,"%s/i2b_live_run.bam",TMPDIR);
+        setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+        free(argv_1[3]);    // the intensities directory
+        argv_1[3] = calloc(1,strlen(run_folder)+64);
+        sprintf(argv_1[3], "%s/Data/Intensities", run_folder);
+        argv_1[argc_1++] = strdup("--live");
+        argv_1[argc_1++] = strdup(store);
+        argv_1[argc_1++] = strdup("--poll-interval");
+        argv_1[argc_1++] = strdup("1");
+
+        if (pthread_create(&copier, NULL, liveCopier, &lc)) { fprintf(stderr,"Can't create copier thread\n"); exit(1); }
+        icheckEqual("Live run: return code", 0, main_i2b(argc_1-1, argv_1+1));
+        pthread_join(copier, NULL);
+        checkFiles("Live run test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+
+        //
+        // run it again without the cycles: they are all in the store, so none are read from the run folder
+        //
+
+        if (verbose) fprintf(stderr,"\n===> Live test, restarted\n");
+        sprintf(stored, "%s/L001/C1.1/s_1_1101.bcl", store);
+        icheckEqual("Live restart: cycle stored", 0, stat(stored, &before));
+        sprintf(command, "rm -rf %s/Data/Intensities/BaseCalls/L001/C*.1", run_folder);
+        if (system(command)) { fprintf(stderr,"Can't remove the cycles\n"); failure++; }
+        sprintf(outputfile2,"%s/i2b_live_run_first.bam",TMPDIR);
+        rename(outputfile, outputfile2);
+        icheckEqual("Live restart: return code", 0, main_i2b(argc_1-1, argv_1+1));
+        icheckEqual("Live restart: cycle kept", 0, stat(stored, &after));
+        icheckEqual("Live restart: same cycle", 1, before.st_ino == after.st_ino && before.st_mtime == after.st_mtime);
+        checkFiles("Live restart test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+        checkRecords("Live restart test", outputfile, outputfile2);
+
+        free_args(argv_1);
+        free(run_folder);
+        free(pending);
+        free(store);
+        free(stored);
+    }
+
+    //
+    // simple test again, written to a shard and joined
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Shard test\n");
+    sprintf(outputfile,"%s/i2b_shard.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--shard-dir");
+    argv_1[argc_1] = calloc(1,strlen(TMPDIR)+64);
+    sprintf(argv_1[argc_1++], "%s/shards", TMPDIR);
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Shard test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+
+    // run it again with the same command line: the tile is already in the shard directory, so it is kept
+    {
+        char *shard = calloc(1,strlen(TMPDIR)+64);
+        struct stat before, after;
+        sprintf(shard, "%s/shards/s_1_1101.bam", TMPDIR);
+        sprintf(outputfile2,"%s/i2b_shard_first.bam",TMPDIR);
+        rename(outputfile, outputfile2);
+        icheckEqual("Shard resume: shard written", 0, stat(shard, &before));
+        icheckEqual("Shard resume: return code", 0, main_i2b(argc_1-1, argv_1+1));
+        icheckEqual("Shard resume: shard kept", 0, stat(shard, &after));
+        icheckEqual("Shard resume: same shard", 1, before.st_ino == after.st_ino && before.st_mtime == after.st_mtime);
+        checkFiles("Shard resume test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+        checkRecords("Shard resume test", outputfile, outputfile2);
+
+        // and with options which don't change the records: the number of threads and the output file
+        sprintf(outputfile,"%s/i2b_shard_threads.bam",TMPDIR);
+        free(argv_1[5]);    // the output file
+        argv_1[5] = strdup(outputfile);
+        argv_1[argc_1++] = strdup("--threads");
+        argv_1[argc_1++] = strdup("3");
+        icheckEqual("Shard resume, other threads: return code", 0, main_i2b(argc_1-1, argv_1+1));
+        icheckEqual("Shard resume, other threads: shard kept", 0, stat(shard, &after));
+        icheckEqual("Shard resume, other threads: same shard", 1, before.st_ino == after.st_ino && before.st_mtime == after.st_mtime);
+        checkRecords("Shard resume, other threads test", outputfile, outputfile2);
+        free(shard);
+    }
+    free_args(argv_1);
+
+    // a shard left by a conversion with different options mustn't be joined into the output
+    if (verbose) fprintf(stderr,"\n===> Shard with different options test\n");
+    sprintf(outputfile,"%s/i2b_shard_rg.bam",TMPDIR);
+    setup_readgroup_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--shard-dir");
+    argv_1[argc_1] = calloc(1,strlen(TMPDIR)+64);
+    sprintf(argv_1[argc_1++], "%s/shards", TMPDIR);
+    icheckEqual("Shard with different options", 1, main_i2b(argc_1-1, argv_1+1) != 0);
+    free_args(argv_1);
+
+    // even when they are not in the header
+    sprintf(outputfile,"%s/i2b_shard_nofilter.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--no-filter");
+    argv_1[argc_1++] = strdup("--shard-dir");
+    argv_1[argc_1] = calloc(1,strlen(TMPDIR)+64);
+    sprintf(argv_1[argc_1++], "%s/shards", TMPDIR);
+    icheckEqual("Shard with a different filter", 1, main_i2b(argc_1-1, argv_1+1) != 0);
+    free_args(argv_1);
+
+    //
+    // Collecting statistics mustn't change the output
+    //
+    if (verbose) fprintf(stderr,"\n===> Stats test\n");
+    sprintf(outputfile,"%s/i2b_stats.bam",TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--stats-json");
+    argv_1[argc_1] = calloc(1,strlen(TMPDIR)+64);
+    sprintf(argv_1[argc_1++], "%s/i2b_stats.json", TMPDIR);
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Stats test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    FILE *stats = fopen(argv_1[argc_1-1], "r");
+    char stats_buf[8192] = "";
+    if (stats) {
+        size_t n = fread(stats_buf, 1, sizeof(stats_buf)-1, stats);
+        stats_buf[n] = 0;
+        fclose(stats);
+    }
+    icheckEqual("Stats records", 1, strstr(stats_buf, "\"records\": 514,") != NULL);
+    icheckEqual("Stats tile", 1, strstr(stats_buf, "\"tile\": 1101,") != NULL);
+    free_args(argv_1);
+
     //
     // Test with non-standard read group ID
     //
@@ -734,7 +1213,20 @@ int main(int argc, char**argv)
     checkFiles("NovaSeq test", outputfile, MKNAME(DATA_DIR,"/out/novaseq_1.sam"));
     free_args(argv_1);
 
+    if (verbose) fprintf(stderr,"\n===> NovaSeq split test\n");
+    sprintf(outputfile,"%s/novaseq_split.sam",TMPDIR);
+    novaseq_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-order");
+    argv_1[argc_1++] = strdup("--min-split-clusters");
+    argv_1[argc_1++] = strdup("4");
+    argv_1[argc_1++] = strdup("--threads");
+    argv_1[argc_1++] = strdup("8");
+    main_i2b(argc_1-1,argv_1+1);
+    checkFiles("NovaSeq split test", outputfile, MKNAME(DATA_DIR,"/out/novaseq_1.sam"));
+    free_args(argv_1);
+
     free(outputfile);
+    free(outputfile2);
 
     printf("i2b tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -109,13 +109,108 @@ int main(int argc, char**argv)
     icheckEqual("LOCS: first Y", 1321, posfile_get_y(posfile));
     icheckEqual("LOCS: current block (2)", 1, posfile->current_block);
 
+    // test.locs is truncated: it has fewer entries than its header says
     while (posfile_next(posfile)==0);
 
-    icheckEqual("LOCS: last x", 14847, posfile_get_x(posfile));
+    icheckEqual("LOCS: last x", 14577, posfile_get_x(posfile));
     icheckEqual("LOCS: last y", 1715, posfile_get_y(posfile));
 
+    posfile_seek(posfile, 636);
+    icheckEqual("LOCS: seek next", 0, posfile_next(posfile));
+    icheckEqual("LOCS: seek x", 17035, posfile_get_x(posfile));
+    icheckEqual("LOCS: seek y", 1715, posfile_get_y(posfile));
+    posfile_seek(posfile, 0);
+    posfile_next(posfile);
+    icheckEqual("LOCS: seek back x", 16440, posfile_get_x(posfile));
+    icheckEqual("LOCS: seek back y", 1321, posfile_get_y(posfile));
+
     posfile_close(posfile);
 
+    /*
+     * posfile_load_tile() must give the same positions as posfile_next()
+     */
+    {
+        char *files[] = { MKNAME(DATA_DIR,"/test.clocs"), MKNAME(DATA_DIR,"/test.locs") };
+        int size = 300000;
+        int32_t *x = malloc(size * sizeof(int32_t));
+        int32_t *y = malloc(size * sizeof(int32_t));
+        for (int f=0; f < 2; f++) {
+            posfile_t *p1 = posfile_open(files[f]);
+            posfile_t *p2 = posfile_open(files[f]);
+            int count = 0, diffs = 0;
+            for (;;) {
+                // odd sized batches, to check we can stop and restart anywhere
+                int r = posfile_load_tile(p2, x + count, y + count, 37);
+                count += r;
+                if (r < 37) break;
+            }
+            for (n=0; n < count; n++) {
+                if (posfile_next(p1) < 0) break;
+                if (p1->x != x[n] || p1->y != y[n]) diffs++;
+            }
+            icheckEqual("load_tile count", n, count);
+            icheckEqual("load_tile at end", -1, posfile_next(p1));
+            icheckEqual("load_tile diffs", 0, diffs);
+            icheckEqual("load_tile last x", p1->x, p2->x);
+            icheckEqual("load_tile last y", p1->y, p2->y);
+            posfile_close(p1);
+            posfile_close(p2);
+        }
+        free(x); free(y);
+    }
+
+    /*
+     * shared files: each reader has its own position over the same data
+     */
+    {
+        posfile_t *p1 = posfile_open_shared(MKNAME(DATA_DIR,"/test.locs"));
+        posfile_t *p2 = posfile_open_shared(MKNAME(DATA_DIR,"/test.locs"));
+        icheckEqual("shared data", 1, p1->data == p2->data);
+        posfile_seek(p1, 636);
+        posfile_next(p1);
+        icheckEqual("shared seek x", 17035, posfile_get_x(p1));
+        posfile_next(p2);
+        icheckEqual("shared first x", 16440, posfile_get_x(p2));
+        posfile_close(p1);
+        posfile_next(p2);
+        posfile_close(p2);
+
+        p1 = posfile_open_shared(MKNAME(DATA_DIR,"/no_such_file.locs"));
+        checkLike("shared missing file", "No such file", p1->errmsg);
+        posfile_close(p1);
+        posfile_free_shared_cache();
+    }
+
+    /*
+     * _pos.txt file
+     */
+    {
+        char template[] = "/tmp/bambi.XXXXXX";
+        char *TMPDIR = mkdtemp(template);
+        char fname[512];
+        int32_t x[4], y[4];
+        sprintf(fname, "%s/s_1_1101_pos.txt", TMPDIR);
+        FILE *fp = fopen(fname, "w");
+        fprintf(fp, "  5.03  1043.74\n 1534.37  14.99\n12.3 45.6\n");
+        fclose(fp);
+
+        posfile = posfile_open(fname);
+        icheckEqual("POS: type", POS, posfile->file_type);
+        icheckEqual("POS: next", 0, posfile_next(posfile));
+        icheckEqual("POS: first X", 1050, posfile_get_x(posfile));
+        icheckEqual("POS: first Y", 11437, posfile_get_y(posfile));
+        icheckEqual("POS: load", 2, posfile_load_tile(posfile, x, y, 4));
+        icheckEqual("POS: second X", 16344, x[0]);
+        icheckEqual("POS: second Y", 1150, y[0]);
+        icheckEqual("POS: third X", 1123, x[1]);
+        icheckEqual("POS: third Y", 1456, y[1]);
+        icheckEqual("POS: at end", -1, posfile_next(posfile));
+        posfile_close(posfile);
+
+        unlink(fname);
+        rmdir(TMPDIR);
+    }
+
     printf("posfile tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }